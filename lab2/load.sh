@@ -3,5 +3,13 @@
 module="pipe-shmipe"
 
 insmod ${module}.ko $@
-major=$(cat /proc/devices | grep $module | sed 's/[ \t]//')
-mknod -m=0666 /dev/$module c $major 0
+major=$(awk -v m=$module '$2 == m { print $1 }' /proc/devices)
+channels=$(cat /sys/module/$(echo $module | tr - _)/parameters/nr_channels)
+
+# Minor 0 keeps the old name, other channels get their number appended
+mknod -m 0666 /dev/$module c $major 0
+i=1
+while [ $i -lt $channels ]; do
+	mknod -m 0666 /dev/$module$i c $major $i
+	i=$((i + 1))
+done
@@ -0,0 +1,692 @@
+/*
+ * Throughput and latency benchmark for pipe-shmipe, with pipe(2) and
+ * socketpair(2) as baselines. Must be run as a regular user, root gets
+ * different file operations on the device.
+ *
+ * Every message starts with the CLOCK_MONOTONIC time it was sent, so
+ * consumers can measure latency. With more than one producer or consumer
+ * packet transports are used to keep messages whole: message mode of
+ * pipe-shmipe, pipe2(O_DIRECT) and SOCK_SEQPACKET.
+ *
+ * One CSV line is printed per configuration, skipped configurations are
+ * reported to stderr.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "pipe-shmipe.h"
+
+#define MAX_LIST 16
+#define MAX_SAMPLES (1 << 20)
+#define MIB (1024.0 * 1024.0)
+
+struct bench;
+
+struct transport {
+	const char *name;
+	int (*setup)(struct bench *b);
+	void (*teardown)(struct bench *b);
+	int (*send)(struct bench *b, const char *buf, size_t len);
+	int (*recv)(struct bench *b, char *buf, size_t len);
+};
+
+struct bench {
+	const struct transport *tr;
+	const char *dev;
+	size_t msg_size;
+	unsigned long buf_size;
+	unsigned long producers;
+	unsigned long consumers;
+	unsigned long msgs;
+	bool packet;
+
+	int wfd;
+	int rfd;
+
+	/* mmap transport */
+	struct pipe_shmipe_ctl *ctl;
+	char *ring;
+	size_t map_size;
+
+	pthread_barrier_t start;
+	pthread_mutex_t lock;
+	uint64_t *samples;
+	size_t nr_samples;
+	unsigned long stride;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int fd_send(struct bench *b, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(b->wfd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+
+		/* Packet must go in whole */
+		if (b->packet && (size_t)ret != len) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int fd_recv(struct bench *b, char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = read(b->rfd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+
+		if (b->packet && (size_t)ret != len) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static void fd_teardown(struct bench *b)
+{
+	close(b->wfd);
+	if (b->rfd != b->wfd)
+		close(b->rfd);
+}
+
+/* Throw away leftovers of earlier runs, the buffer is shared per user */
+static int shmipe_drain(int fd)
+{
+	char buf[4096];
+	int flags = fcntl(fd, F_GETFL);
+
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+		return -1;
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	return fcntl(fd, F_SETFL, flags);
+}
+
+static int shmipe_open(struct bench *b, int flags)
+{
+	int mode = b->packet ? PIPE_SHMIPE_MODE_MSG : PIPE_SHMIPE_MODE_STREAM;
+	int fd;
+
+	if (geteuid() == 0) {
+		fprintf(stderr, "pipe-shmipe can't be benchmarked as root\n");
+		errno = EPERM;
+		return -1;
+	}
+
+	fd = open(b->dev, flags);
+	if (fd < 0)
+		return -1;
+
+	if (shmipe_drain(fd) || ioctl(fd, PIPE_SHMIPE_SET_MODE, mode) < 0
+		|| ioctl(fd, PIPE_SHMIPE_SET_SIZE, b->buf_size) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int shmipe_setup(struct bench *b)
+{
+	if (b->packet && b->msg_size > b->buf_size - 1 - sizeof(__u32)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	b->rfd = shmipe_open(b, O_RDONLY);
+	if (b->rfd < 0)
+		return -1;
+
+	b->wfd = open(b->dev, O_WRONLY);
+	if (b->wfd < 0) {
+		close(b->rfd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mmap_setup(struct bench *b)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	/* Ring protocol is single producer, single consumer */
+	if (b->producers != 1 || b->consumers != 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	b->rfd = shmipe_open(b, O_RDWR);
+	if (b->rfd < 0)
+		return -1;
+	b->wfd = b->rfd;
+
+	b->map_size = page + ioctl(b->rfd, PIPE_SHMIPE_GET_SIZE);
+	b->ctl = mmap(NULL, b->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		b->rfd, 0);
+	if (b->ctl == MAP_FAILED) {
+		close(b->rfd);
+		return -1;
+	}
+
+	b->ring = (char *)b->ctl + page;
+
+	return 0;
+}
+
+static void mmap_teardown(struct bench *b)
+{
+	munmap(b->ctl, b->map_size);
+	close(b->rfd);
+}
+
+static int mmap_send(struct bench *b, const char *buf, size_t len)
+{
+	struct pipe_shmipe_ctl *ctl = b->ctl;
+	__u32 mask = ctl->size - 1;
+	__u32 head, tail, space, chunk;
+
+	while (len) {
+		head = ctl->head & mask;
+		tail = __atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE) & mask;
+		space = (tail - head - 1) & mask;
+
+		if (space == 0) {
+			if (ioctl(b->wfd, PIPE_SHMIPE_WAIT_SPACE) < 0
+				&& errno != EINTR)
+				return -1;
+			continue;
+		}
+
+		chunk = space < len ? space : len;
+		if (chunk > mask + 1 - head)
+			chunk = mask + 1 - head;
+
+		memcpy(b->ring + head, buf, chunk);
+		__atomic_store_n(&ctl->head, (head + chunk) & mask,
+			__ATOMIC_RELEASE);
+
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ctl->read_waiters, __ATOMIC_RELAXED))
+			ioctl(b->wfd, PIPE_SHMIPE_WAKE);
+
+		buf += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+static int mmap_recv(struct bench *b, char *buf, size_t len)
+{
+	struct pipe_shmipe_ctl *ctl = b->ctl;
+	__u32 mask = ctl->size - 1;
+	__u32 head, tail, cnt, chunk;
+
+	while (len) {
+		tail = ctl->tail & mask;
+		head = __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE) & mask;
+		cnt = (head - tail) & mask;
+
+		if (cnt == 0) {
+			if (ioctl(b->rfd, PIPE_SHMIPE_WAIT_DATA) < 0
+				&& errno != EINTR)
+				return -1;
+			continue;
+		}
+
+		chunk = cnt < len ? cnt : len;
+		if (chunk > mask + 1 - tail)
+			chunk = mask + 1 - tail;
+
+		memcpy(buf, b->ring + tail, chunk);
+		__atomic_store_n(&ctl->tail, (tail + chunk) & mask,
+			__ATOMIC_RELEASE);
+
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ctl->write_waiters, __ATOMIC_RELAXED))
+			ioctl(b->rfd, PIPE_SHMIPE_WAKE);
+
+		buf += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+static int pipe_setup(struct bench *b)
+{
+	int fds[2];
+
+	/* Bigger packets would be split */
+	if (b->packet && b->msg_size > PIPE_BUF) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (pipe2(fds, b->packet ? O_DIRECT : 0))
+		return -1;
+
+	if (fcntl(fds[1], F_SETPIPE_SZ, b->buf_size) < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	b->rfd = fds[0];
+	b->wfd = fds[1];
+
+	return 0;
+}
+
+static int socketpair_setup(struct bench *b)
+{
+	int type = b->packet ? SOCK_SEQPACKET : SOCK_STREAM;
+	int size = b->buf_size;
+	int sv[2];
+
+	if (b->packet && b->msg_size > b->buf_size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (socketpair(AF_UNIX, type, 0, sv))
+		return -1;
+
+	if (setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size))
+		|| setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size,
+			sizeof(size))) {
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	b->wfd = sv[0];
+	b->rfd = sv[1];
+
+	return 0;
+}
+
+static const struct transport transports[] = {
+	{ "shmipe", shmipe_setup, fd_teardown, fd_send, fd_recv },
+	{ "mmap", mmap_setup, mmap_teardown, mmap_send, mmap_recv },
+	{ "pipe", pipe_setup, fd_teardown, fd_send, fd_recv },
+	{ "socketpair", socketpair_setup, fd_teardown, fd_send, fd_recv },
+};
+
+static void *producer(void *arg)
+{
+	struct bench *b = arg;
+	char *buf = calloc(1, b->msg_size);
+	unsigned long i;
+	uint64_t stamp;
+
+	if (buf == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_barrier_wait(&b->start);
+
+	for (i = 0; i < b->msgs; i++) {
+		stamp = now_ns();
+		memcpy(buf, &stamp, sizeof(stamp));
+
+		if (b->tr->send(b, buf, b->msg_size)) {
+			perror("send");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+/* Runs until it gets a message with zero timestamp */
+static void *consumer(void *arg)
+{
+	struct bench *b = arg;
+	size_t max = MAX_SAMPLES / b->consumers;
+	char *buf = malloc(b->msg_size);
+	uint64_t *samples = malloc(max * sizeof(*samples));
+	unsigned long i;
+	size_t nr = 0;
+	uint64_t stamp;
+
+	if (buf == NULL || samples == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_barrier_wait(&b->start);
+
+	for (i = 0;; i++) {
+		if (b->tr->recv(b, buf, b->msg_size)) {
+			perror("recv");
+			exit(EXIT_FAILURE);
+		}
+
+		memcpy(&stamp, buf, sizeof(stamp));
+		if (stamp == 0)
+			break;
+
+		if (i % b->stride == 0 && nr < max)
+			samples[nr++] = now_ns() - stamp;
+	}
+
+	pthread_mutex_lock(&b->lock);
+	memcpy(b->samples + b->nr_samples, samples, nr * sizeof(*samples));
+	b->nr_samples += nr;
+	pthread_mutex_unlock(&b->lock);
+
+	free(samples);
+	free(buf);
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static long csw(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+static void run(struct bench *b)
+{
+	pthread_t threads[2 * MAX_LIST];
+	unsigned long nr = b->producers + b->consumers;
+	unsigned long i;
+	char *poison;
+	uint64_t start, elapsed;
+	long start_csw, nr_csw;
+	double bytes;
+
+	b->packet = b->producers > 1 || b->consumers > 1;
+
+	if (b->tr->setup(b)) {
+		fprintf(stderr, "skip %s p=%lu c=%lu msg=%zu buf=%lu: %s\n",
+			b->tr->name, b->producers, b->consumers, b->msg_size,
+			b->buf_size, strerror(errno));
+		return;
+	}
+
+	b->nr_samples = 0;
+	b->stride = (b->msgs * b->producers + MAX_SAMPLES - 1) / MAX_SAMPLES;
+	b->samples = malloc(MAX_SAMPLES * sizeof(*b->samples));
+	poison = calloc(1, b->msg_size);
+	if (b->samples == NULL || poison == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_barrier_init(&b->start, NULL, nr + 1);
+
+	for (i = 0; i < nr; i++)
+		pthread_create(&threads[i], NULL,
+			i < b->producers ? producer : consumer, b);
+
+	pthread_barrier_wait(&b->start);
+	start = now_ns();
+	start_csw = csw();
+
+	for (i = 0; i < b->producers; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Every consumer stops after exactly one poison message */
+	for (i = 0; i < b->consumers; i++)
+		if (b->tr->send(b, poison, b->msg_size)) {
+			perror("send");
+			exit(EXIT_FAILURE);
+		}
+
+	for (; i < nr; i++)
+		pthread_join(threads[i], NULL);
+
+	elapsed = now_ns() - start;
+	nr_csw = csw() - start_csw;
+
+	pthread_barrier_destroy(&b->start);
+	b->tr->teardown(b);
+
+	qsort(b->samples, b->nr_samples, sizeof(*b->samples), cmp_u64);
+	bytes = (double)b->msgs * b->producers * b->msg_size;
+
+	printf("%s,%lu,%lu,%zu,%lu,%.0f,%.6f,%.2f,%.0f,%llu,%llu,%.2f\n",
+		b->tr->name, b->producers, b->consumers, b->msg_size,
+		b->buf_size, bytes, elapsed / 1e9,
+		bytes / MIB / (elapsed / 1e9),
+		b->msgs * b->producers / (elapsed / 1e9),
+		b->nr_samples ? (unsigned long long)
+			b->samples[b->nr_samples / 2] : 0,
+		b->nr_samples ? (unsigned long long)
+			b->samples[b->nr_samples * 99 / 100] : 0,
+		nr_csw / (bytes / MIB));
+	fflush(stdout);
+
+	free(poison);
+	free(b->samples);
+}
+
+/* Comma separated list of numbers with optional k/m suffix */
+static int parse_list(const char *s, unsigned long *list)
+{
+	int nr = 0;
+	char *end;
+
+	while (*s) {
+		if (nr == MAX_LIST)
+			return -1;
+
+		list[nr] = strtoul(s, &end, 0);
+		if (end == s)
+			return -1;
+
+		if (*end == 'k' || *end == 'K')
+			list[nr] <<= 10, end++;
+		else if (*end == 'm' || *end == 'M')
+			list[nr] <<= 20, end++;
+
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -1;
+
+		nr++;
+		s = end;
+	}
+
+	return nr;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dev] [-t transports] [-s sizes] [-b bufs]\n"
+		"          [-p producers] [-c consumers] [-n MiB]\n"
+		"\n"
+		"  -d  device, default /dev/pipe-shmipe\n"
+		"  -t  any of shmipe,mmap,pipe,socketpair, default all\n"
+		"  -s  message sizes, default 64,512,4k,64k\n"
+		"  -b  buffer sizes, default 4k,64k,1m\n"
+		"  -p  producer counts, default 1\n"
+		"  -c  consumer counts, default 1\n"
+		"  -n  MiB sent per configuration, default 64\n"
+		"\n"
+		"Lists are comma separated, sizes take k and m suffixes.\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+static unsigned long sizes[MAX_LIST] = { 64, 512, 4096, 65536 };
+static unsigned long bufs[MAX_LIST] = { 4096, 65536, 1 << 20 };
+static unsigned long producers[MAX_LIST] = { 1 };
+static unsigned long consumers[MAX_LIST] = { 1 };
+static int nr_sizes = 4;
+static int nr_bufs = 3;
+static int nr_producers = 1;
+static int nr_consumers = 1;
+
+/* Run every combination of parameters over one transport */
+static void sweep(struct bench *b, unsigned long total)
+{
+	int s, f, p, c;
+
+	for (s = 0; s < nr_sizes; s++) {
+		for (f = 0; f < nr_bufs; f++) {
+			for (p = 0; p < nr_producers; p++) {
+				for (c = 0; c < nr_consumers; c++) {
+					b->msg_size = sizes[s];
+					b->buf_size = bufs[f];
+					b->producers = producers[p];
+					b->consumers = consumers[c];
+					b->msgs = (total << 20) / b->msg_size
+						/ b->producers;
+					if (b->msgs == 0)
+						b->msgs = 1;
+
+					run(b);
+				}
+			}
+		}
+	}
+}
+
+/* Whole entry of comma separated list */
+static bool listed(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+	const char *hit;
+
+	for (hit = strstr(list, name); hit; hit = strstr(hit + 1, name))
+		if ((hit == list || hit[-1] == ',')
+			&& (hit[len] == 0 || hit[len] == ','))
+			return true;
+
+	return false;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *names = "shmipe,mmap,pipe,socketpair";
+	struct bench b = { .dev = "/dev/pipe-shmipe" };
+	unsigned long total = 64;
+	unsigned int t;
+	int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:t:s:b:p:c:n:")) != -1) {
+		switch (opt) {
+		case 'd':
+			b.dev = optarg;
+			break;
+		case 't':
+			names = optarg;
+			break;
+		case 's':
+			nr_sizes = parse_list(optarg, sizes);
+			break;
+		case 'b':
+			nr_bufs = parse_list(optarg, bufs);
+			break;
+		case 'p':
+			nr_producers = parse_list(optarg, producers);
+			break;
+		case 'c':
+			nr_consumers = parse_list(optarg, consumers);
+			break;
+		case 'n':
+			total = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (nr_sizes <= 0 || nr_bufs <= 0 || nr_producers <= 0
+		|| nr_consumers <= 0 || total == 0)
+		usage(argv[0]);
+
+	for (i = 0; i < nr_sizes; i++)
+		if (sizes[i] < sizeof(uint64_t))
+			usage(argv[0]);
+
+	for (i = 0; i < nr_producers; i++)
+		if (producers[i] == 0 || producers[i] > MAX_LIST)
+			usage(argv[0]);
+
+	for (i = 0; i < nr_consumers; i++)
+		if (consumers[i] == 0 || consumers[i] > MAX_LIST)
+			usage(argv[0]);
+
+	pthread_mutex_init(&b.lock, NULL);
+
+	printf("transport,producers,consumers,msg_size,buf_size,bytes,"
+		"seconds,mib_s,msgs_s,p50_ns,p99_ns,csw_per_mib\n");
+
+	for (t = 0; t < sizeof(transports) / sizeof(*transports); t++) {
+		if (!listed(names, transports[t].name))
+			continue;
+
+		b.tr = &transports[t];
+		sweep(&b, total);
+	}
+
+	return 0;
+}
@@ -0,0 +1,1234 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/slab.h>
+#include <linux/circ_buf.h>
+#include <linux/mutex.h>
+#include <linux/errno.h>
+#include <linux/cred.h>
+#include <linux/uidgid.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/bvec.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/topology.h>
+#include <linux/timer.h>
+#include <linux/jiffies.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <asm/uaccess.h>
+
+#include "pipe-shmipe.h"
+#include "pipe-user.h"
+
+#define CREATE_TRACE_POINTS
+#include "pipe-shmipe-trace.h"
+
+static unsigned int buf_size = 4096;
+module_param(buf_size, uint, 0444);
+MODULE_PARM_DESC(buf_size,
+	"circular buffer size, only nonzero power of 2 allowed (default 4096)");
+
+static unsigned int max_buf_size = 1 << 20;
+module_param(max_buf_size, uint, 0644);
+MODULE_PARM_DESC(max_buf_size,
+	"maximum buffer size users may request at runtime (default 1048576)");
+
+static unsigned int nr_channels = 1;
+module_param(nr_channels, uint, 0444);
+MODULE_PARM_DESC(nr_channels,
+	"number of minors, each with own buffer per user (default 1)");
+
+static bool numa_migrate;
+module_param(numa_migrate, bool, 0644);
+MODULE_PARM_DESC(numa_migrate,
+	"move buffer to NUMA node its reader runs on (default off)");
+
+static ssize_t pipe_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t pipe_write_iter(struct kiocb *, struct iov_iter *);
+static ssize_t pipe_splice_read(struct file *, loff_t *,
+	struct pipe_inode_info *, size_t, unsigned int);
+static ssize_t pipe_splice_write(struct pipe_inode_info *, struct file *,
+	loff_t *, size_t, unsigned int);
+static __poll_t pipe_poll(struct file *, poll_table *);
+static long pipe_ioctl(struct file *, unsigned int, unsigned long);
+static int pipe_mmap(struct file *, struct vm_area_struct *);
+static int pipe_open(struct inode *, struct file *);
+static int pipe_release(struct inode *, struct file *);
+
+static ssize_t pipe_read_root(struct file *, char __user *, size_t, loff_t *);
+static ssize_t
+pipe_write_root(struct file *, const char __user *, size_t, loff_t *);
+
+static const struct file_operations fops = {
+	.owner = THIS_MODULE,
+	.read_iter = pipe_read_iter,
+	.write_iter = pipe_write_iter,
+	.splice_read = pipe_splice_read,
+	.splice_write = pipe_splice_write,
+	.poll = pipe_poll,
+	.unlocked_ioctl = pipe_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = pipe_mmap,
+	.open = pipe_open,
+	.release = pipe_release,
+};
+
+static const struct file_operations fops_root = {
+	.owner = THIS_MODULE,
+	.read = pipe_read_root,
+	.write = pipe_write_root,
+};
+
+static dev_t devt;
+static struct cdev pipe_cdev;
+
+#define MAX_CHANNELS 256
+#define NUMA_MIGRATE_READS 64
+#define MSG_HDR_SIZE sizeof(u32)
+#define MAX_FLUSH_TIMEOUT 1000
+
+static int pipe_set_mode(struct pipe_user *, unsigned long);
+
+
+static int pipe_open(struct inode *inode, struct file *file)
+{
+	struct pipe_user *usrp;
+	kuid_t uid = current_uid();
+	int ret;
+
+	if (uid_eq(uid, GLOBAL_ROOT_UID)) {
+		file->f_op = &fops_root;
+		return 0;
+	}
+
+	file->f_op = &fops;
+
+	/* Now let's find or create buffer for current user on this minor */
+
+	usrp = pipe_user_get(uid, iminor(inode), buf_size);
+	if (usrp == NULL)
+		return -ENOMEM;
+
+	file->private_data = usrp;
+
+	/*
+	 * Like pipe2(O_DIRECT), opening with O_DIRECT selects message mode.
+	 * Stream openers already on the channel would start seeing record
+	 * headers, so only the first opener may switch it.
+	 */
+	if (file->f_flags & O_DIRECT) {
+		ret = 0;
+		if (!READ_ONCE(usrp->msg_mode)) {
+			ret = -EBUSY;
+			if (kref_read(&usrp->count) == 1)
+				ret = pipe_set_mode(usrp, PIPE_SHMIPE_MODE_MSG);
+		}
+		if (ret) {
+			pipe_user_put(usrp);
+			return ret;
+		}
+
+		file->f_mode |= FMODE_CAN_ODIRECT;
+	}
+
+	return 0;
+}
+
+static int pipe_release(struct inode *inode, struct file *file)
+{
+	struct pipe_user *usrp = file->private_data;
+
+	pipe_user_put(usrp);
+
+	return 0;
+}
+
+/*
+ * Free pages of drained ring, called by reader with read_lock held. Writer
+ * and mmap() can't be waited for here, so just give up if they are busy,
+ * next drain will try again.
+ */
+static void pipe_shrink(struct pipe_user *usrp)
+{
+	if (atomic_read(&usrp->mapped) || !pipe_ring_need_shrink(&usrp->ring))
+		return;
+
+	if (!mutex_trylock(&usrp->write_lock))
+		return;
+
+	if (mutex_trylock(&usrp->shape_lock)) {
+		if (pipe_ring_cnt(&usrp->ring) == 0
+			&& !atomic_read(&usrp->mapped))
+			pipe_ring_shrink(&usrp->ring);
+		mutex_unlock(&usrp->shape_lock);
+	}
+
+	mutex_unlock(&usrp->write_lock);
+}
+
+/* Take side lock, failing instead of sleeping for nonblocking tasks */
+static int pipe_lock(struct mutex *lock, bool nonblock)
+{
+	if (nonblock)
+		return mutex_trylock(lock) ? 0 : -EAGAIN;
+
+	return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
+
+/* Called after waking up with the time task went to sleep */
+static void pipe_account_block(struct pipe_user *usrp, bool write,
+	ktime_t start)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+	unsigned int bucket = 0;
+
+	if (us)
+		bucket = min_t(unsigned int, ilog2(us) + 1,
+			BLOCK_HIST_BUCKETS - 1);
+
+	if (write)
+		this_cpu_inc(usrp->stats->write_block_hist[bucket]);
+	else
+		this_cpu_inc(usrp->stats->read_block_hist[bucket]);
+
+	trace_pipe_shmipe_block(__kuid_val(usrp->uid), usrp->channel, write,
+		ns);
+}
+
+/*
+ * Sleep until there is data, called with read_lock held. Lock is dropped
+ * while sleeping, so resize, mode change and mmap() never wait for data,
+ * and taken again before checking the ring, since other readers may have
+ * drained it meanwhile. Flag in control page tells mmap() writers that
+ * they have to call PIPE_SHMIPE_WAKE, it stays set while any reader
+ * sleeps. Barrier orders flag store before reading head and pairs with
+ * barrier between head update and flag check in userspace writer.
+ */
+static int
+pipe_wait_data(struct pipe_user *usrp, unsigned int need, bool nonblock)
+{
+	ktime_t start;
+	int ret = 0;
+
+	for (;;) {
+		if (pipe_ring_cnt(&usrp->ring) >= need)
+			return 0;
+
+		if (nonblock)
+			return -EAGAIN;
+
+		if (ret)
+			return -ERESTARTSYS;
+
+		usrp->read_sleepers++;
+		WRITE_ONCE(usrp->ring.ctl->read_waiters, 1);
+		smp_mb();
+
+		/* Only time the wait if it is still needed after the flag */
+		if (pipe_ring_cnt(&usrp->ring) < need) {
+			mutex_unlock(&usrp->read_lock);
+			start = ktime_get();
+			ret = wait_event_interruptible_exclusive(
+				usrp->read_wait,
+				pipe_ring_cnt(&usrp->ring) >= need);
+			pipe_account_block(usrp, false, start);
+			mutex_lock(&usrp->read_lock);
+		}
+
+		if (--usrp->read_sleepers == 0)
+			WRITE_ONCE(usrp->ring.ctl->read_waiters, 0);
+	}
+}
+
+/*
+ * Sleep until there is space, called with write_lock held and dropping
+ * it like pipe_wait_data() does. Ring may be shrunk meanwhile, so a
+ * record which can't fit anymore fails instead of waiting forever.
+ */
+static int
+pipe_wait_space(struct pipe_user *usrp, unsigned int need, bool nonblock)
+{
+	ktime_t start;
+	int ret = 0;
+
+	for (;;) {
+		if (pipe_ring_space(&usrp->ring) >= need)
+			return 0;
+
+		if (need > usrp->ring.size - 1)
+			return -EMSGSIZE;
+
+		if (nonblock)
+			return -EAGAIN;
+
+		if (ret)
+			return -ERESTARTSYS;
+
+		usrp->write_sleepers++;
+		WRITE_ONCE(usrp->ring.ctl->write_waiters, 1);
+		smp_mb();
+
+		/* Only time the wait if it is still needed after the flag */
+		if (pipe_ring_space(&usrp->ring) < need) {
+			mutex_unlock(&usrp->write_lock);
+			start = ktime_get();
+			ret = wait_event_interruptible_exclusive(
+				usrp->write_wait,
+				pipe_ring_space(&usrp->ring) >= need
+				|| need > READ_ONCE(usrp->ring.size) - 1);
+			pipe_account_block(usrp, true, start);
+			mutex_lock(&usrp->write_lock);
+		}
+
+		if (--usrp->write_sleepers == 0)
+			WRITE_ONCE(usrp->ring.ctl->write_waiters, 0);
+	}
+}
+
+/*
+ * Waits are exclusive, and a woken task may find that someone who never
+ * slept took what it was woken for. Whoever leaves data or space behind
+ * passes the wakeup on to the next sleeper of the same side.
+ */
+static void pipe_pass_wakeup(wait_queue_head_t *wq, unsigned int left)
+{
+	if (left && wq_has_sleeper(wq))
+		wake_up(wq);
+}
+
+/*
+ * Wake up reader once there is at least low_wmark bytes, otherwise make
+ * sure sleeping reader gets flushed after flush_timeout. Called after
+ * publishing data with write_lock held, at the end of a write or when
+ * the ring is full. Without flush timeout nothing else would wake up
+ * reader sleeping below low_wmark, so it is woken every time.
+ */
+static void pipe_wake_reader(struct pipe_user *usrp)
+{
+	unsigned int cnt = pipe_ring_cnt(&usrp->ring);
+	unsigned int timeout = READ_ONCE(usrp->flush_timeout);
+
+	if (cnt >= READ_ONCE(usrp->low_wmark) || !timeout) {
+		this_cpu_inc(usrp->stats->read_wakeups);
+		trace_pipe_shmipe_wake(__kuid_val(usrp->uid), usrp->channel,
+			false, cnt);
+		wake_up(&usrp->read_wait);
+		return;
+	}
+
+	this_cpu_inc(usrp->stats->coalesced_wakeups);
+
+	if (wq_has_sleeper(&usrp->read_wait)
+		&& !timer_pending(&usrp->flush_timer))
+		mod_timer(&usrp->flush_timer,
+			jiffies + msecs_to_jiffies(timeout));
+}
+
+/* Wake up writer once buffer holds less than high_wmark bytes */
+static void pipe_wake_writer(struct pipe_user *usrp)
+{
+	unsigned int cnt = pipe_ring_cnt(&usrp->ring);
+
+	if (cnt >= READ_ONCE(usrp->high_wmark))
+		return;
+
+	this_cpu_inc(usrp->stats->write_wakeups);
+	trace_pipe_shmipe_wake(__kuid_val(usrp->uid), usrp->channel, true,
+		cnt);
+	wake_up(&usrp->write_wait);
+}
+
+static void pipe_account_write(struct pipe_user *usrp, size_t bytes)
+{
+	this_cpu_inc(usrp->stats->writes);
+	this_cpu_add(usrp->stats->write_bytes, bytes);
+	trace_pipe_shmipe_write(__kuid_val(usrp->uid), usrp->channel, bytes,
+		pipe_ring_cnt(&usrp->ring));
+}
+
+/*
+ * Update statistics and let ring follow its reader to another NUMA node,
+ * called with read_lock held after each successful read.
+ */
+static void pipe_account_read(struct pipe_user *usrp, size_t bytes)
+{
+	int node;
+
+	/* Reader got flushed data, next flush needs another timeout */
+	if (READ_ONCE(usrp->flush_expired))
+		WRITE_ONCE(usrp->flush_expired, false);
+
+	this_cpu_inc(usrp->stats->reads);
+	this_cpu_add(usrp->stats->read_bytes, bytes);
+	trace_pipe_shmipe_read(__kuid_val(usrp->uid), usrp->channel, bytes,
+		pipe_ring_cnt(&usrp->ring));
+
+	if (!numa_migrate)
+		return;
+
+	node = numa_node_id();
+
+	if (node == usrp->ring.nid) {
+		usrp->read_streak = 0;
+		return;
+	}
+
+	if (node != usrp->read_nid) {
+		usrp->read_nid = node;
+		usrp->read_streak = 0;
+	}
+
+	if (++usrp->read_streak >= NUMA_MIGRATE_READS) {
+		WRITE_ONCE(usrp->ring.nid, node);
+		usrp->read_streak = 0;
+	}
+}
+
+/*
+ * Length of record at tail. Records are always published whole, so a
+ * length running past head means userspace messed up mapped ring.
+ */
+static int pipe_msg_len(struct pipe_user *usrp, unsigned int head,
+	unsigned int tail, u32 *len)
+{
+	unsigned int cnt = CIRC_CNT(head, tail, usrp->ring.size);
+
+	if (cnt < MSG_HDR_SIZE)
+		return -EIO;
+
+	pipe_ring_memcpy_out(&usrp->ring, len, tail, MSG_HDR_SIZE);
+
+	if (*len > cnt - MSG_HDR_SIZE)
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * Read one record, called with read_lock held. Like with packet pipes,
+ * part of record which doesn't fit into iterator is discarded.
+ */
+static ssize_t pipe_read_msg(struct pipe_user *usrp, struct iov_iter *to)
+{
+	unsigned int mask = usrp->ring.size - 1;
+	unsigned int head;
+	unsigned int tail;
+	size_t count;
+	u32 len;
+	int ret;
+
+	head = smp_load_acquire(&usrp->ring.ctl->head) & mask;
+	tail = READ_ONCE(usrp->ring.ctl->tail) & mask;
+
+	ret = pipe_msg_len(usrp, head, tail, &len);
+	if (ret)
+		return ret;
+
+	count = min_t(size_t, len, iov_iter_count(to));
+
+	if (pipe_ring_to_iter(&usrp->ring, (tail + MSG_HDR_SIZE) & mask,
+		count, to) < count)
+		return -EFAULT;
+
+	smp_store_release(&usrp->ring.ctl->tail,
+		(tail + MSG_HDR_SIZE + len) & mask);
+
+	return count;
+}
+
+/*
+ * Write whole iterator as one record, called with write_lock held once
+ * there is enough space. Record is published only after it is complete,
+ * so on fault nothing is written.
+ */
+static ssize_t pipe_write_msg(struct pipe_user *usrp, struct iov_iter *from)
+{
+	unsigned int mask = usrp->ring.size - 1;
+	u32 len = iov_iter_count(from);
+	unsigned int head;
+	ssize_t ret;
+
+	head = READ_ONCE(usrp->ring.ctl->head) & mask;
+
+	ret = pipe_ring_memcpy_in(&usrp->ring, head, &len, MSG_HDR_SIZE);
+	if (ret)
+		return ret;
+
+	ret = pipe_ring_from_iter(&usrp->ring, (head + MSG_HDR_SIZE) & mask,
+		len, from);
+	if (ret < 0)
+		return ret;
+	if (ret < len)
+		return -EFAULT;
+
+	smp_store_release(&usrp->ring.ctl->head,
+		(head + MSG_HDR_SIZE + len) & mask);
+
+	return len;
+}
+
+/*
+ * Copy as many whole records as fit into user buffer, each with its length
+ * header, like they are stored in ring. They lie back to back in ring, so
+ * it is a single copy once the boundary is found.
+ */
+static long pipe_read_batch(struct file *file, void __user *argp)
+{
+	struct pipe_shmipe_batch __user *ubatch = argp;
+	struct pipe_user *usrp = file->private_data;
+	bool nonblock = file->f_flags & O_NONBLOCK;
+	struct pipe_shmipe_batch batch;
+	struct iov_iter to;
+	unsigned int mask;
+	unsigned int head;
+	unsigned int tail;
+	size_t total = 0;
+	u32 nr_msgs = 0;
+	u32 len;
+	long ret;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+
+	ret = import_ubuf(ITER_DEST, u64_to_user_ptr(batch.buf), batch.len,
+		&to);
+	if (ret)
+		return ret;
+
+	ret = pipe_lock(&usrp->read_lock, nonblock);
+	if (ret)
+		return ret;
+
+	ret = pipe_wait_data(usrp, 1, nonblock);
+	if (ret)
+		goto out;
+
+	/* Checked after waiting, mode may change while lock is dropped */
+	if (!usrp->msg_mode) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	mask = usrp->ring.size - 1;
+	head = smp_load_acquire(&usrp->ring.ctl->head) & mask;
+	tail = READ_ONCE(usrp->ring.ctl->tail) & mask;
+
+	while (head != ((tail + total) & mask)
+		&& (!batch.max_msgs || nr_msgs < batch.max_msgs)) {
+		ret = pipe_msg_len(usrp, head, (tail + total) & mask, &len);
+		if (ret)
+			goto out;
+
+		if (total + MSG_HDR_SIZE + len > batch.len)
+			break;
+
+		total += MSG_HDR_SIZE + len;
+		nr_msgs++;
+	}
+
+	if (nr_msgs == 0) {
+		ret = -EMSGSIZE;
+		goto out;
+	}
+
+	/* Records stay in the ring until the caller can be told about them */
+	if (pipe_ring_to_iter(&usrp->ring, tail, total, &to) < total ||
+	    put_user(nr_msgs, &ubatch->nr_msgs)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	smp_store_release(&usrp->ring.ctl->tail, (tail + total) & mask);
+
+	pipe_account_read(usrp, total);
+	if (pipe_ring_cnt(&usrp->ring) == 0)
+		pipe_shrink(usrp);
+
+	ret = total;
+
+out:
+	mutex_unlock(&usrp->read_lock);
+
+	if (ret > 0)
+		pipe_wake_writer(usrp);
+	pipe_pass_wakeup(&usrp->read_wait, pipe_ring_cnt(&usrp->ring));
+
+	return ret;
+}
+
+static bool pipe_nonblock(struct kiocb *iocb)
+{
+	return iocb->ki_filp->f_flags & O_NONBLOCK
+		|| iocb->ki_flags & IOCB_NOWAIT;
+}
+
+static ssize_t pipe_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct pipe_user *usrp = iocb->ki_filp->private_data;
+	bool nonblock = pipe_nonblock(iocb);
+	ssize_t ret;
+
+	if (iov_iter_count(to) == 0)
+		return 0;
+
+	ret = pipe_lock(&usrp->read_lock, nonblock);
+	if (ret)
+		return ret;
+
+	ret = pipe_wait_data(usrp, 1, nonblock);
+	if (ret)
+		goto out;
+
+	if (usrp->msg_mode)
+		ret = pipe_read_msg(usrp, to);
+	else
+		ret = pipe_ring_read(&usrp->ring, to);
+
+	if (ret > 0)
+		pipe_account_read(usrp, ret);
+
+	if (ret > 0 && pipe_ring_cnt(&usrp->ring) == 0)
+		pipe_shrink(usrp);
+
+out:
+	mutex_unlock(&usrp->read_lock);
+
+	if (ret > 0)
+		pipe_wake_writer(usrp);
+	pipe_pass_wakeup(&usrp->read_wait, pipe_ring_cnt(&usrp->ring));
+
+	return ret;
+}
+
+/*
+ * Write as much as fits, wake up reader and continue until whole user
+ * buffer is consumed. Reader is woken once per chunk of ring space, not
+ * once per iterator segment. If interrupted or out of space in nonblocking
+ * mode, report what was already written. Like with pipe(2), a write
+ * which has to wait for space may be interleaved with other writers.
+ *
+ * In message mode whole iterator goes in as one record, or nothing does.
+ *
+ * Also used by iter_file_splice_write() to move pipe buffers in.
+ */
+static ssize_t pipe_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct pipe_user *usrp = iocb->ki_filp->private_data;
+	bool nonblock = pipe_nonblock(iocb);
+	size_t written = 0;
+	ssize_t ret = 0;
+
+	ret = pipe_lock(&usrp->write_lock, nonblock);
+	if (ret)
+		return ret;
+
+	if (usrp->msg_mode && iov_iter_count(from)) {
+		/* Ring of 2 or 4 bytes holds no record at all */
+		if (MSG_HDR_SIZE + iov_iter_count(from) > usrp->ring.size - 1) {
+			ret = -EMSGSIZE;
+			goto out;
+		}
+
+		ret = pipe_wait_space(usrp,
+			MSG_HDR_SIZE + iov_iter_count(from), nonblock);
+		if (!ret)
+			ret = pipe_write_msg(usrp, from);
+		if (ret > 0)
+			pipe_wake_reader(usrp);
+		goto out;
+	}
+
+	while (iov_iter_count(from)) {
+		ret = pipe_wait_space(usrp, 1, nonblock);
+		if (ret)
+			break;
+
+		ret = pipe_ring_write(&usrp->ring, from);
+		if (ret < 0)
+			break;
+
+		written += ret;
+
+		pipe_wake_reader(usrp);
+	}
+
+	if (written)
+		ret = written;
+
+out:
+	if (ret > 0)
+		pipe_account_write(usrp, ret);
+
+	mutex_unlock(&usrp->write_lock);
+
+	pipe_pass_wakeup(&usrp->write_wait, pipe_ring_space(&usrp->ring));
+
+	return ret;
+}
+
+static void
+pipe_splice_release_page(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/* Pages are private copies of ring data, so they may be stolen */
+static const struct pipe_buf_operations pipe_splice_buf_ops = {
+	.release = generic_pipe_buf_release,
+	.try_steal = generic_pipe_buf_try_steal,
+	.get = generic_pipe_buf_get,
+};
+
+/*
+ * Ring memory is reused, so it can't be handed to pipe directly. Copy data
+ * into fresh pages instead and advance tail only by the amount pipe has
+ * actually accepted, the rest stays in ring for the next reader.
+ */
+static ssize_t pipe_splice_read(struct file *file, loff_t *ppos,
+	struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct pipe_user *usrp = file->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.ops = &pipe_splice_buf_ops,
+		.spd_release = pipe_splice_release_page,
+	};
+	bool nonblock = flags & SPLICE_F_NONBLOCK
+		|| file->f_flags & O_NONBLOCK;
+	unsigned int head;
+	unsigned int tail;
+	size_t count;
+	size_t off;
+	ssize_t ret;
+
+	ret = pipe_lock(&usrp->read_lock, nonblock);
+	if (ret)
+		return ret;
+
+	ret = pipe_wait_data(usrp, 1, nonblock);
+	if (ret)
+		goto out;
+
+	/* Pages carry no record boundaries, mode may change while waiting */
+	if (usrp->msg_mode) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	head = smp_load_acquire(&usrp->ring.ctl->head) & (usrp->ring.size - 1);
+	tail = READ_ONCE(usrp->ring.ctl->tail) & (usrp->ring.size - 1);
+
+	count = min_t(size_t, len, CIRC_CNT(head, tail, usrp->ring.size));
+	count = min_t(size_t, count, PIPE_DEF_BUFFERS * PAGE_SIZE);
+
+	for (off = 0; off < count; off += PAGE_SIZE) {
+		size_t chunk = min_t(size_t, count - off, PAGE_SIZE);
+		struct page *page;
+
+		page = alloc_page(GFP_KERNEL);
+		if (page == NULL)
+			break;
+
+		pipe_ring_memcpy_out(&usrp->ring, page_address(page),
+			(tail + off) & (usrp->ring.size - 1), chunk);
+
+		pages[spd.nr_pages] = page;
+		partial[spd.nr_pages].offset = 0;
+		partial[spd.nr_pages].len = chunk;
+		spd.nr_pages++;
+	}
+
+	if (spd.nr_pages == 0) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = splice_to_pipe(pipe, &spd);
+
+	/* Finish reading data before releasing it to writer */
+	if (ret > 0)
+		smp_store_release(&usrp->ring.ctl->tail,
+			(tail + ret) & (usrp->ring.size - 1));
+
+	if (ret > 0)
+		pipe_account_read(usrp, ret);
+
+	if (ret > 0 && pipe_ring_cnt(&usrp->ring) == 0)
+		pipe_shrink(usrp);
+
+out:
+	mutex_unlock(&usrp->read_lock);
+
+	if (ret > 0)
+		pipe_wake_writer(usrp);
+	pipe_pass_wakeup(&usrp->read_wait, pipe_ring_cnt(&usrp->ring));
+
+	return ret;
+}
+
+/*
+ * Move one pipe buffer in for nonblocking splice, with IOCB_NOWAIT, so
+ * pipe_write_iter() takes the same path as for O_NONBLOCK.
+ */
+static int pipe_splice_actor(struct pipe_inode_info *pipe,
+	struct pipe_buffer *pbuf, struct splice_desc *sd)
+{
+	struct bio_vec bvec;
+	struct iov_iter from;
+	struct kiocb kiocb;
+
+	bvec_set_page(&bvec, pbuf->page, sd->len, pbuf->offset);
+	iov_iter_bvec(&from, ITER_SOURCE, &bvec, 1, sd->len);
+
+	init_sync_kiocb(&kiocb, sd->u.file);
+	kiocb.ki_flags |= IOCB_NOWAIT;
+
+	return pipe_write_iter(&kiocb, &from);
+}
+
+/*
+ * Pipe buffers carry no record boundaries, so only stream mode is allowed.
+ * iter_file_splice_write() passes no flags to write_iter, so nonblocking
+ * splice goes buffer by buffer and gets -EAGAIN instead of sleeping.
+ */
+static ssize_t pipe_splice_write(struct pipe_inode_info *pipe,
+	struct file *file, loff_t *ppos, size_t len, unsigned int flags)
+{
+	struct pipe_user *usrp = file->private_data;
+
+	if (READ_ONCE(usrp->msg_mode))
+		return -EINVAL;
+
+	if (flags & SPLICE_F_NONBLOCK)
+		return splice_from_pipe(pipe, file, ppos, len, flags,
+			pipe_splice_actor);
+
+	return iter_file_splice_write(pipe, file, ppos, len, flags);
+}
+
+static __poll_t pipe_poll(struct file *file, poll_table *wait)
+{
+	struct pipe_user *usrp = file->private_data;
+	unsigned int cnt;
+	__poll_t mask = 0;
+
+	poll_wait(file, &usrp->read_wait, wait);
+	poll_wait(file, &usrp->write_wait, wait);
+
+	cnt = pipe_ring_cnt(&usrp->ring);
+
+	/* Data below low_wmark is flushed to pollers too */
+	if (cnt >= READ_ONCE(usrp->low_wmark)
+		|| (cnt && READ_ONCE(usrp->flush_expired)))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	/* In message mode a header and at least one byte of record must fit */
+	if (cnt < READ_ONCE(usrp->high_wmark) &&
+	    (!READ_ONCE(usrp->msg_mode) ||
+	     pipe_ring_space(&usrp->ring) >= MSG_HDR_SIZE + 1))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+static int pipe_set_wmark(struct pipe_user *usrp, void __user *argp)
+{
+	struct pipe_shmipe_wmark wmark;
+
+	if (copy_from_user(&wmark, argp, sizeof(wmark)))
+		return -EFAULT;
+
+	/* Keep size stable while checking against it */
+	if (mutex_lock_interruptible(&usrp->shape_lock))
+		return -ERESTARTSYS;
+
+	if (wmark.low < 1 || wmark.low > usrp->ring.size - 1
+		|| wmark.high < 1 || wmark.high > usrp->ring.size - 1) {
+		mutex_unlock(&usrp->shape_lock);
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(usrp->low_wmark, wmark.low);
+	WRITE_ONCE(usrp->high_wmark, wmark.high);
+
+	mutex_unlock(&usrp->shape_lock);
+
+	/* Let pollers reevaluate readiness with new thresholds */
+	wake_up(&usrp->read_wait);
+	wake_up(&usrp->write_wait);
+
+	return 0;
+}
+
+static int pipe_set_flush(struct pipe_user *usrp, unsigned long timeout)
+{
+	if (timeout > MAX_FLUSH_TIMEOUT)
+		return -EINVAL;
+
+	WRITE_ONCE(usrp->flush_timeout, timeout);
+
+	return 0;
+}
+
+static int pipe_get_wmark(struct pipe_user *usrp, void __user *argp)
+{
+	struct pipe_shmipe_wmark wmark = {
+		.low = READ_ONCE(usrp->low_wmark),
+		.high = READ_ONCE(usrp->high_wmark),
+	};
+
+	if (copy_to_user(argp, &wmark, sizeof(wmark)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Take both side locks and shape_lock, so no data moves and ring may be
+ * reshaped. Side locks are never held while sleeping, so this only waits
+ * for copies in progress.
+ */
+static int pipe_lock_both(struct pipe_user *usrp)
+{
+	if (mutex_lock_interruptible(&usrp->read_lock))
+		return -ERESTARTSYS;
+
+	if (mutex_lock_interruptible(&usrp->write_lock))
+		goto err_write;
+
+	if (mutex_lock_interruptible(&usrp->shape_lock))
+		goto err_shape;
+
+	return 0;
+
+err_shape:
+	mutex_unlock(&usrp->write_lock);
+err_write:
+	mutex_unlock(&usrp->read_lock);
+	return -ERESTARTSYS;
+}
+
+static void pipe_unlock_both(struct pipe_user *usrp)
+{
+	mutex_unlock(&usrp->shape_lock);
+	mutex_unlock(&usrp->write_lock);
+	mutex_unlock(&usrp->read_lock);
+}
+
+/*
+ * Framing can't change under data, so pipe must be empty and unmapped.
+ * Writer sleeping for space would resume in the new mode, so it must not
+ * be there either. Sleeping readers check mode once they are back.
+ */
+static int pipe_set_mode(struct pipe_user *usrp, unsigned long mode)
+{
+	int ret;
+
+	if (mode != PIPE_SHMIPE_MODE_STREAM && mode != PIPE_SHMIPE_MODE_MSG)
+		return -EINVAL;
+
+	/* Nothing to do, don't wait for copies in progress */
+	if (READ_ONCE(usrp->msg_mode) == (mode == PIPE_SHMIPE_MODE_MSG))
+		return 0;
+
+	ret = pipe_lock_both(usrp);
+	if (ret)
+		return ret;
+
+	if (usrp->msg_mode != (mode == PIPE_SHMIPE_MODE_MSG)) {
+		if (pipe_ring_cnt(&usrp->ring) > 0
+			|| atomic_read(&usrp->mapped) || usrp->write_sleepers)
+			ret = -EBUSY;
+		else
+			WRITE_ONCE(usrp->msg_mode,
+				mode == PIPE_SHMIPE_MODE_MSG);
+	}
+
+	pipe_unlock_both(usrp);
+
+	return ret;
+}
+
+/*
+ * Like F_SETPIPE_SZ: size is rounded up to power of 2 and must hold data
+ * already in the pipe. Data is moved to the start of new ring. Mapped ring
+ * can't be resized, since its pages are in use by userspace.
+ */
+static long pipe_set_size(struct pipe_user *usrp, unsigned long arg)
+{
+	unsigned int old_size;
+	unsigned int size;
+	long ret;
+
+	if (arg < 2)
+		return -EINVAL;
+
+	if (arg > max_buf_size || roundup_pow_of_two(arg) > max_buf_size)
+		return -EPERM;
+
+	size = roundup_pow_of_two(arg);
+
+	ret = pipe_lock_both(usrp);
+	if (ret)
+		return ret;
+
+	if (atomic_read(&usrp->mapped)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	old_size = usrp->ring.size;
+
+	ret = pipe_ring_resize(&usrp->ring, size);
+	if (ret)
+		goto out;
+
+	/* Keep watermarks within ring, default high one follows its size */
+	if (usrp->high_wmark == old_size - 1 || usrp->high_wmark >= size)
+		WRITE_ONCE(usrp->high_wmark, size - 1);
+	if (usrp->low_wmark >= size)
+		WRITE_ONCE(usrp->low_wmark, size - 1);
+
+	ret = size;
+
+out:
+	pipe_unlock_both(usrp);
+
+	/* Every sleeper has to recheck, record may not fit anymore */
+	if (ret > 0) {
+		wake_up_all(&usrp->read_wait);
+		wake_up_all(&usrp->write_wait);
+	}
+
+	return ret;
+}
+
+/*
+ * WAIT_* commands are for mmap() users. Side lock is taken like in
+ * read()/write() and dropped while sleeping, so they may be mixed with
+ * each other on one pipe.
+ */
+static long pipe_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct pipe_user *usrp = file->private_data;
+	void __user *argp = (void __user *)arg;
+	int ret;
+
+	switch (cmd) {
+	case PIPE_SHMIPE_WAIT_DATA:
+		if (mutex_lock_interruptible(&usrp->read_lock))
+			return -ERESTARTSYS;
+		ret = pipe_wait_data(usrp, 1, false);
+		mutex_unlock(&usrp->read_lock);
+		return ret;
+
+	case PIPE_SHMIPE_WAIT_SPACE:
+		if (mutex_lock_interruptible(&usrp->write_lock))
+			return -ERESTARTSYS;
+		ret = pipe_wait_space(usrp, 1, false);
+		mutex_unlock(&usrp->write_lock);
+		return ret;
+
+	case PIPE_SHMIPE_WAKE:
+		wake_up(&usrp->read_wait);
+		wake_up(&usrp->write_wait);
+		return 0;
+
+	case PIPE_SHMIPE_SET_WMARK:
+		return pipe_set_wmark(usrp, argp);
+
+	case PIPE_SHMIPE_GET_WMARK:
+		return pipe_get_wmark(usrp, argp);
+
+	case PIPE_SHMIPE_SET_SIZE:
+		return pipe_set_size(usrp, arg);
+
+	case PIPE_SHMIPE_GET_SIZE:
+		return READ_ONCE(usrp->ring.size);
+
+	case PIPE_SHMIPE_SET_MODE:
+		return pipe_set_mode(usrp, arg);
+
+	case PIPE_SHMIPE_GET_MODE:
+		return READ_ONCE(usrp->msg_mode) ? PIPE_SHMIPE_MODE_MSG
+			: PIPE_SHMIPE_MODE_STREAM;
+
+	case PIPE_SHMIPE_READ_BATCH:
+		return pipe_read_batch(file, argp);
+
+	case PIPE_SHMIPE_SET_FLUSH:
+		return pipe_set_flush(usrp, arg);
+
+	case PIPE_SHMIPE_GET_FLUSH:
+		return READ_ONCE(usrp->flush_timeout);
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Mapping count keeps pages from being freed or reshaped under userspace */
+static void pipe_vm_open(struct vm_area_struct *vma)
+{
+	struct pipe_user *usrp = vma->vm_private_data;
+
+	atomic_inc(&usrp->mapped);
+}
+
+static void pipe_vm_close(struct vm_area_struct *vma)
+{
+	struct pipe_user *usrp = vma->vm_private_data;
+
+	atomic_dec(&usrp->mapped);
+}
+
+static const struct vm_operations_struct pipe_vm_ops = {
+	.open = pipe_vm_open,
+	.close = pipe_vm_close,
+};
+
+/*
+ * Control page is at page offset 0, ring pages follow. Called with
+ * mmap_lock held, which readers and writers take while holding side locks
+ * when copies fault, so only shape_lock is taken here. Pages are
+ * allocated in parallel with writer, ring serializes that.
+ */
+static int pipe_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct pipe_user *usrp = file->private_data;
+	unsigned long pgoff;
+	unsigned long i;
+	struct page *page;
+	int ret;
+
+	/* Private copy of the ring makes no sense */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&usrp->shape_lock))
+		return -ERESTARTSYS;
+
+	if (vma->vm_pgoff + vma_pages(vma) > 1 + usrp->ring.nr_pages) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Mapped ring is never shrunk, so populate it in full */
+	for (i = 0; i < usrp->ring.nr_pages; i++) {
+		if (pipe_ring_get_page(&usrp->ring, i << PAGE_SHIFT) == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+
+	for (i = 0; i < vma_pages(vma); i++) {
+		pgoff = vma->vm_pgoff + i;
+
+		if (pgoff == 0)
+			page = virt_to_page(usrp->ring.ctl);
+		else
+			page = usrp->ring.pages[pgoff - 1];
+
+		ret = vm_insert_page(vma, vma->vm_start + i * PAGE_SIZE, page);
+		if (ret)
+			goto out;
+	}
+
+	vma->vm_private_data = usrp;
+	vma->vm_ops = &pipe_vm_ops;
+	atomic_inc(&usrp->mapped);
+
+out:
+	mutex_unlock(&usrp->shape_lock);
+	return ret;
+}
+
+static ssize_t
+pipe_read_root(struct file *file, char __user *buf, size_t count, loff_t *offp)
+{
+	pr_warn("only mere mortals can read from here\n");
+
+	return 0;
+}
+
+static ssize_t
+pipe_write_root(
+	struct file *file, const char __user *buf, size_t count, loff_t *offp)
+{
+	pr_warn("only mere mortals can write here\n");
+
+	return -EFAULT;
+}
+
+static int __init pipe_init(void)
+{
+	int ret;
+
+	if (!buf_size || buf_size & (buf_size - 1)) {
+		pr_err("buf_size must be nonzero power of 2\n");
+		return -EINVAL;
+	}
+
+	if (!nr_channels || nr_channels > MAX_CHANNELS) {
+		pr_err("nr_channels must be within [1, %d]\n", MAX_CHANNELS);
+		return -EINVAL;
+	}
+
+	ret = pipe_users_init();
+	if (ret)
+		return ret;
+
+	ret = alloc_chrdev_region(&devt, 0, nr_channels, "pipe-shmipe");
+	if (ret) {
+		pr_err("failed to allocate device numbers\n");
+		goto err_region;
+	}
+
+	cdev_init(&pipe_cdev, &fops);
+	pipe_cdev.owner = THIS_MODULE;
+
+	ret = cdev_add(&pipe_cdev, devt, nr_channels);
+	if (ret) {
+		pr_err("failed to add char device\n");
+		goto err_cdev;
+	}
+
+	return 0;
+
+err_cdev:
+	unregister_chrdev_region(devt, nr_channels);
+err_region:
+	pipe_users_exit();
+	return ret;
+}
+
+static void __exit pipe_exit(void)
+{
+	pipe_users_exit();
+
+	cdev_del(&pipe_cdev);
+	unregister_chrdev_region(devt, nr_channels);
+}
+
+module_init(pipe_init);
+module_exit(pipe_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Pipe module");
+MODULE_AUTHOR("Dmitry Gerasimov <di.gerasimov@gmail.com>");
@@ -0,0 +1,387 @@
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/circ_buf.h>
+#include <linux/minmax.h>
+#include <linux/uio.h>
+#include <kunit/visibility.h>
+
+#include "pipe-ring.h"
+
+/* Indices are kept in [0, size), size is a power of 2 */
+static inline unsigned int
+ring_advance(unsigned int pos, size_t n, unsigned int size)
+{
+	return (pos + n) & (size - 1);
+}
+
+/*
+ * Bytes from pos up to end of its page or end of ring, whatever is less,
+ * so one copy never crosses page boundary or ring end.
+ */
+static inline size_t
+ring_chunk(unsigned int pos, size_t len, unsigned int size)
+{
+	len = min_t(size_t, len, PAGE_SIZE - offset_in_page(pos));
+	return min_t(size_t, len, size - pos);
+}
+
+static void ring_free_pages(struct page **pages, unsigned int nr_pages)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_pages; i++)
+		if (pages[i] != NULL)
+			__free_page(pages[i]);
+
+	kvfree(pages);
+}
+
+/* Zeroed, since it may end up mapped into userspace */
+static struct page *ring_alloc_page(struct pipe_ring *ring)
+{
+	return alloc_pages_node(READ_ONCE(ring->nid),
+		GFP_KERNEL_ACCOUNT | __GFP_ZERO, 0);
+}
+
+/* Empty ring of size bytes, power of 2, with everything on node nid */
+int pipe_ring_init(struct pipe_ring *ring, unsigned int size, int nid)
+{
+	struct page *ctl_page;
+
+	ctl_page = alloc_pages_node(nid, GFP_KERNEL | __GFP_ZERO, 0);
+	if (ctl_page == NULL)
+		return -ENOMEM;
+
+	ring->ctl = page_address(ctl_page);
+
+	/* Only page pointers, ring pages are allocated on first write */
+	ring->nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	ring->pages = kvzalloc_node(ring->nr_pages * sizeof(*ring->pages),
+		GFP_KERNEL, nid);
+	if (ring->pages == NULL) {
+		free_page((unsigned long)ring->ctl);
+		return -ENOMEM;
+	}
+
+	ring->nr_allocated = 0;
+	ring->size = size;
+	ring->ctl->size = size;
+	ring->nid = nid;
+	spin_lock_init(&ring->lock);
+
+	return 0;
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_ring_init);
+
+void pipe_ring_free(struct pipe_ring *ring)
+{
+	ring_free_pages(ring->pages, ring->nr_pages);
+	free_page((unsigned long)ring->ctl);
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_ring_free);
+
+/* Data available for reader */
+unsigned int pipe_ring_cnt(struct pipe_ring *ring)
+{
+	return CIRC_CNT(smp_load_acquire(&ring->ctl->head),
+		READ_ONCE(ring->ctl->tail), READ_ONCE(ring->size));
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_ring_cnt);
+
+/* Space available for writer */
+unsigned int pipe_ring_space(struct pipe_ring *ring)
+{
+	return CIRC_SPACE(READ_ONCE(ring->ctl->head),
+		smp_load_acquire(&ring->ctl->tail), READ_ONCE(ring->size));
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_ring_space);
+
+/*
+ * Make sure page at ring position is present, called by writer and by
+ * mmap(). Page is allocated without lock, whoever installs it first wins.
+ * Pointer is published to reader together with data by release of head.
+ */
+struct page *pipe_ring_get_page(struct pipe_ring *ring, unsigned int pos)
+{
+	struct page **slot = &ring->pages[pos >> PAGE_SHIFT];
+	struct page *page = READ_ONCE(*slot);
+	struct page *new;
+
+	if (page != NULL)
+		return page;
+
+	new = ring_alloc_page(ring);
+	if (new == NULL)
+		return NULL;
+
+	spin_lock(&ring->lock);
+	page = *slot;
+	if (page == NULL) {
+		page = new;
+		new = NULL;
+		WRITE_ONCE(*slot, page);
+		ring->nr_allocated++;
+	}
+	spin_unlock(&ring->lock);
+
+	if (new != NULL)
+		__free_page(new);
+
+	return page;
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_ring_get_page);
+
+/* Copy len bytes starting at pos out of ring, wrapping if needed */
+void pipe_ring_memcpy_out(struct pipe_ring *ring, void *dst,
+	unsigned int pos, size_t len)
+{
+	while (len) {
+		size_t chunk = ring_chunk(pos, len, ring->size);
+		struct page *page = READ_ONCE(ring->pages[pos >> PAGE_SHIFT]);
+
+		memcpy(dst, page_address(page) + offset_in_page(pos), chunk);
+
+		dst += chunk;
+		len -= chunk;
+		pos = ring_advance(pos, chunk, ring->size);
+	}
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_ring_memcpy_out);
+
+/* Copy len bytes into ring starting at pos, called by writer */
+int pipe_ring_memcpy_in(struct pipe_ring *ring, unsigned int pos,
+	const void *src, size_t len)
+{
+	while (len) {
+		size_t chunk = ring_chunk(pos, len, ring->size);
+		struct page *page = pipe_ring_get_page(ring, pos);
+
+		if (page == NULL)
+			return -ENOMEM;
+
+		memcpy(page_address(page) + offset_in_page(pos), src, chunk);
+
+		src += chunk;
+		len -= chunk;
+		pos = ring_advance(pos, chunk, ring->size);
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_ring_memcpy_in);
+
+/*
+ * Copy len bytes starting at pos out of ring into iterator. Iterator may
+ * have many segments, they are all filled in one pass. Returns number of
+ * bytes copied, which is less than len on fault.
+ */
+size_t pipe_ring_to_iter(struct pipe_ring *ring, unsigned int pos,
+	size_t len, struct iov_iter *to)
+{
+	size_t copied = 0;
+
+	while (copied < len) {
+		size_t chunk = ring_chunk(pos, len - copied, ring->size);
+		struct page *page = READ_ONCE(ring->pages[pos >> PAGE_SHIFT]);
+		size_t n;
+
+		n = copy_page_to_iter(page, offset_in_page(pos), chunk, to);
+		copied += n;
+
+		if (n < chunk)
+			break;
+
+		pos = ring_advance(pos, chunk, ring->size);
+	}
+
+	return copied;
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_ring_to_iter);
+
+/*
+ * Copy len bytes from iterator into ring starting at pos, called by
+ * writer. Returns number of bytes copied, which is less than len on
+ * fault, or -ENOMEM if nothing was copied for lack of pages.
+ */
+ssize_t pipe_ring_from_iter(struct pipe_ring *ring, unsigned int pos,
+	size_t len, struct iov_iter *from)
+{
+	size_t copied = 0;
+
+	while (copied < len) {
+		size_t chunk = ring_chunk(pos, len - copied, ring->size);
+		struct page *page;
+		size_t n;
+
+		page = pipe_ring_get_page(ring, pos);
+		if (page == NULL)
+			return copied ? copied : -ENOMEM;
+
+		n = copy_page_from_iter(page, offset_in_page(pos), chunk, from);
+		copied += n;
+
+		if (n < chunk)
+			break;
+
+		pos = ring_advance(pos, chunk, ring->size);
+	}
+
+	return copied;
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_ring_from_iter);
+
+/*
+ * Copy as much as possible out of ring into iterator, called by reader.
+ * Short copy on fault still consumes what was copied.
+ */
+ssize_t pipe_ring_read(struct pipe_ring *ring, struct iov_iter *to)
+{
+	unsigned int mask = ring->size - 1;
+	size_t count;
+	size_t copied;
+	unsigned int head;
+	unsigned int tail;
+
+	/* Read index before reading contents at that index */
+	head = smp_load_acquire(&ring->ctl->head) & mask;
+	tail = READ_ONCE(ring->ctl->tail) & mask;
+
+	count = min_t(size_t, iov_iter_count(to),
+		CIRC_CNT(head, tail, ring->size));
+
+	copied = pipe_ring_to_iter(ring, tail, count, to);
+	if (copied == 0)
+		return -EFAULT;
+
+	/* Finish reading data before releasing it to writer */
+	smp_store_release(&ring->ctl->tail, (tail + copied) & mask);
+
+	return copied;
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_ring_read);
+
+/* Copy as much as fits from iterator into ring, called by writer */
+ssize_t pipe_ring_write(struct pipe_ring *ring, struct iov_iter *from)
+{
+	unsigned int mask = ring->size - 1;
+	size_t count;
+	ssize_t copied;
+	unsigned int head;
+	unsigned int tail;
+
+	/* Reader must be done with the space before we overwrite it */
+	head = READ_ONCE(ring->ctl->head) & mask;
+	tail = smp_load_acquire(&ring->ctl->tail) & mask;
+
+	count = min_t(size_t, iov_iter_count(from),
+		CIRC_SPACE(head, tail, ring->size));
+
+	copied = pipe_ring_from_iter(ring, head, count, from);
+	if (copied <= 0)
+		return copied ? copied : -EFAULT;
+
+	/* Publish data before making it visible to reader */
+	smp_store_release(&ring->ctl->head, (head + copied) & mask);
+
+	return copied;
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_ring_write);
+
+/*
+ * Quick check, without excluding writer, whether drained ring holds pages
+ * it doesn't need. Page under head is kept for the next write, so
+ * ping-pong traffic doesn't allocate a page per message, unless it is on
+ * a wrong NUMA node.
+ */
+bool pipe_ring_need_shrink(struct pipe_ring *ring)
+{
+	unsigned int keep;
+	struct page *page;
+
+	keep = (READ_ONCE(ring->ctl->head) & (ring->size - 1)) >> PAGE_SHIFT;
+	page = READ_ONCE(ring->pages[keep]);
+
+	return READ_ONCE(ring->nr_allocated) != (page != NULL) ||
+		(page != NULL && page_to_nid(page) != READ_ONCE(ring->nid));
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_ring_need_shrink);
+
+/* Free pages of empty ring but the one kept for the next write */
+void pipe_ring_shrink(struct pipe_ring *ring)
+{
+	struct page *page;
+	unsigned int keep;
+	unsigned int i;
+
+	keep = (READ_ONCE(ring->ctl->head) & (ring->size - 1)) >> PAGE_SHIFT;
+
+	for (i = 0; i < ring->nr_pages; i++) {
+		page = ring->pages[i];
+
+		if (page == NULL
+			|| (i == keep && page_to_nid(page) == ring->nid))
+			continue;
+
+		__free_page(page);
+		ring->pages[i] = NULL;
+		ring->nr_allocated--;
+	}
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_ring_shrink);
+
+/*
+ * Move data to the start of a new ring of size bytes, power of 2, called
+ * with both sides excluded. Fails with -EBUSY if data doesn't fit.
+ */
+int pipe_ring_resize(struct pipe_ring *ring, unsigned int size)
+{
+	unsigned int nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	unsigned int mask = ring->size - 1;
+	struct page **pages;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int cnt;
+	unsigned int off;
+
+	head = READ_ONCE(ring->ctl->head) & mask;
+	tail = READ_ONCE(ring->ctl->tail) & mask;
+	cnt = CIRC_CNT(head, tail, ring->size);
+
+	if (cnt >= size)
+		return -EBUSY;
+
+	pages = kvzalloc_node(nr_pages * sizeof(*pages), GFP_KERNEL,
+		ring->nid);
+	if (pages == NULL)
+		return -ENOMEM;
+
+	for (off = 0; off < cnt; off += PAGE_SIZE) {
+		size_t chunk = min_t(size_t, cnt - off, PAGE_SIZE);
+
+		struct page *page = ring_alloc_page(ring);
+
+		if (page == NULL) {
+			ring_free_pages(pages, nr_pages);
+			return -ENOMEM;
+		}
+
+		pages[off >> PAGE_SHIFT] = page;
+		pipe_ring_memcpy_out(ring, page_address(page),
+			(tail + off) & mask, chunk);
+	}
+
+	ring_free_pages(ring->pages, ring->nr_pages);
+
+	ring->pages = pages;
+	ring->nr_pages = nr_pages;
+	ring->nr_allocated = DIV_ROUND_UP(cnt, PAGE_SIZE);
+
+	WRITE_ONCE(ring->size, size);
+	WRITE_ONCE(ring->ctl->size, size);
+	WRITE_ONCE(ring->ctl->tail, 0);
+	WRITE_ONCE(ring->ctl->head, cnt);
+
+	return 0;
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_ring_resize);
@@ -0,0 +1,61 @@
+#ifndef _PIPE_RING_H_
+#define _PIPE_RING_H_
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/uio.h>
+
+#include "pipe-shmipe.h"
+
+struct page;
+
+/*
+ * Circular buffer. Only writer moves head and only reader moves tail,
+ * each publishes its index with smp_store_release() after touching the
+ * data and reads the other one with smp_load_acquire().
+ * See Documentation/core-api/circular-buffers.rst.
+ *
+ * Indices live in separate control page. It may be mapped into tasks
+ * calling mmap(), so indices may be changed by userspace at any time and
+ * are always masked before use.
+ *
+ * Ring of size bytes (power of 2) is backed by nr_pages pages which are
+ * allocated on node nid as data arrives and freed once reader drains the
+ * ring. Caller serializes each side. Pages may be allocated by writer and
+ * by mmap() at the same time, lock serializes them. Pages are freed and
+ * size is changed only with both of them excluded.
+ */
+struct pipe_ring {
+	struct pipe_shmipe_ctl *ctl;
+	struct page **pages;
+	unsigned int nr_pages;
+	unsigned int nr_allocated;
+	unsigned int size;
+	int nid;
+	spinlock_t lock;
+};
+
+int pipe_ring_init(struct pipe_ring *ring, unsigned int size, int nid);
+void pipe_ring_free(struct pipe_ring *ring);
+
+unsigned int pipe_ring_cnt(struct pipe_ring *ring);
+unsigned int pipe_ring_space(struct pipe_ring *ring);
+
+struct page *pipe_ring_get_page(struct pipe_ring *ring, unsigned int pos);
+void pipe_ring_memcpy_out(struct pipe_ring *ring, void *dst,
+	unsigned int pos, size_t len);
+int pipe_ring_memcpy_in(struct pipe_ring *ring, unsigned int pos,
+	const void *src, size_t len);
+size_t pipe_ring_to_iter(struct pipe_ring *ring, unsigned int pos,
+	size_t len, struct iov_iter *to);
+ssize_t pipe_ring_from_iter(struct pipe_ring *ring, unsigned int pos,
+	size_t len, struct iov_iter *from);
+
+ssize_t pipe_ring_read(struct pipe_ring *ring, struct iov_iter *to);
+ssize_t pipe_ring_write(struct pipe_ring *ring, struct iov_iter *from);
+
+bool pipe_ring_need_shrink(struct pipe_ring *ring);
+void pipe_ring_shrink(struct pipe_ring *ring);
+int pipe_ring_resize(struct pipe_ring *ring, unsigned int size);
+
+#endif
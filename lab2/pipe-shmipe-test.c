@@ -0,0 +1,832 @@
+/*
+ * KUnit suite for pipe-shmipe ring and per-user lookup. Stress cases run
+ * readers, writers, resizer and lookup threads as kthreads, checking that
+ * every record arrives whole and in order. Benchmarks are marked slow and
+ * only report ns per operation, they never fail on timing.
+ */
+#include <kunit/test.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/delay.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/atomic.h>
+#include <linux/random.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/topology.h>
+
+#include "pipe-ring.h"
+#include "pipe-user.h"
+
+MODULE_IMPORT_NS("EXPORTED_FOR_KUNIT_TESTING");
+
+/* Far above ids real users get, so tests never share their buffers */
+#define TEST_UID 0x7ffe0000
+
+#define STRESS_TIMEOUT (30 * HZ)
+#define STRESS_WAIT msecs_to_jiffies(10)
+#define STRESS_MAX_THREADS 8
+#define STRESS_BATCH 8
+
+static ssize_t ring_put(struct pipe_ring *ring, const void *buf, size_t len)
+{
+	struct kvec kv = { .iov_base = (void *)buf, .iov_len = len };
+	struct iov_iter from;
+
+	iov_iter_kvec(&from, ITER_SOURCE, &kv, 1, len);
+
+	return pipe_ring_write(ring, &from);
+}
+
+static ssize_t ring_get(struct pipe_ring *ring, void *buf, size_t len)
+{
+	struct kvec kv = { .iov_base = buf, .iov_len = len };
+	struct iov_iter to;
+
+	iov_iter_kvec(&to, ITER_DEST, &kv, 1, len);
+
+	return pipe_ring_read(ring, &to);
+}
+
+static void fill(u8 *buf, size_t len, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = seed + i * 7;
+}
+
+static void ring_init_test(struct kunit *test)
+{
+	struct pipe_ring ring;
+
+	KUNIT_ASSERT_EQ(test, pipe_ring_init(&ring, 2 * PAGE_SIZE,
+		numa_node_id()), 0);
+
+	KUNIT_EXPECT_EQ(test, pipe_ring_cnt(&ring), 0);
+	KUNIT_EXPECT_EQ(test, pipe_ring_space(&ring), 2 * PAGE_SIZE - 1);
+	KUNIT_EXPECT_EQ(test, ring.nr_pages, 2);
+	KUNIT_EXPECT_EQ(test, ring.nr_allocated, 0);
+	KUNIT_EXPECT_EQ(test, ring.ctl->size, 2 * PAGE_SIZE);
+
+	pipe_ring_free(&ring);
+}
+
+/*
+ * Odd sized copies through iterators walk head and tail around the ring
+ * many times, so they cross page boundaries and ring end at every offset.
+ */
+static void ring_wrap_test(struct kunit *test)
+{
+	size_t len = 1000;
+	struct pipe_ring ring;
+	unsigned int i;
+	u8 *in, *out;
+
+	in = kunit_kmalloc(test, len, GFP_KERNEL);
+	out = kunit_kmalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, in);
+	KUNIT_ASSERT_NOT_NULL(test, out);
+
+	KUNIT_ASSERT_EQ(test, pipe_ring_init(&ring, 2 * PAGE_SIZE,
+		numa_node_id()), 0);
+
+	for (i = 0; i < 100; i++) {
+		fill(in, len, i);
+		KUNIT_ASSERT_EQ(test, ring_put(&ring, in, len), len);
+		KUNIT_EXPECT_EQ(test, pipe_ring_cnt(&ring), len);
+		KUNIT_EXPECT_EQ(test, pipe_ring_cnt(&ring)
+			+ pipe_ring_space(&ring), 2 * PAGE_SIZE - 1);
+
+		memset(out, 0, len);
+		KUNIT_ASSERT_EQ(test, ring_get(&ring, out, len), len);
+		KUNIT_EXPECT_MEMEQ(test, in, out, len);
+	}
+
+	/* Copy straddling ring end */
+	fill(in, 64, 42);
+	KUNIT_ASSERT_EQ(test, pipe_ring_memcpy_in(&ring, ring.size - 10, in,
+		64), 0);
+	memset(out, 0, 64);
+	pipe_ring_memcpy_out(&ring, out, ring.size - 10, 64);
+	KUNIT_EXPECT_MEMEQ(test, in, out, 64);
+
+	pipe_ring_free(&ring);
+}
+
+/* One byte always stays free, so full ring is told from empty one */
+static void ring_full_test(struct kunit *test)
+{
+	size_t len = 2 * PAGE_SIZE;
+	struct pipe_ring ring;
+	u8 *in, *out;
+
+	in = kunit_kmalloc(test, len, GFP_KERNEL);
+	out = kunit_kmalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, in);
+	KUNIT_ASSERT_NOT_NULL(test, out);
+	fill(in, len, 1);
+
+	KUNIT_ASSERT_EQ(test, pipe_ring_init(&ring, len, numa_node_id()), 0);
+
+	KUNIT_EXPECT_EQ(test, ring_put(&ring, in, len), len - 1);
+	KUNIT_EXPECT_EQ(test, pipe_ring_space(&ring), 0);
+	KUNIT_EXPECT_EQ(test, ring.nr_allocated, 2);
+
+	KUNIT_EXPECT_EQ(test, ring_get(&ring, out, len), len - 1);
+	KUNIT_EXPECT_MEMEQ(test, in, out, len - 1);
+	KUNIT_EXPECT_EQ(test, pipe_ring_cnt(&ring), 0);
+
+	pipe_ring_free(&ring);
+}
+
+/* Drained ring gives its pages back but the one under head */
+static void ring_shrink_test(struct kunit *test)
+{
+	size_t len = 3 * PAGE_SIZE;
+	struct pipe_ring ring;
+	u8 *buf;
+
+	buf = kunit_kzalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+
+	KUNIT_ASSERT_EQ(test, pipe_ring_init(&ring, 4 * PAGE_SIZE,
+		numa_node_id()), 0);
+
+	KUNIT_EXPECT_FALSE(test, pipe_ring_need_shrink(&ring));
+
+	KUNIT_ASSERT_EQ(test, ring_put(&ring, buf, len), len);
+	KUNIT_ASSERT_EQ(test, ring_get(&ring, buf, len), len);
+	KUNIT_EXPECT_EQ(test, ring.nr_allocated, 3);
+	KUNIT_EXPECT_TRUE(test, pipe_ring_need_shrink(&ring));
+
+	pipe_ring_shrink(&ring);
+	KUNIT_EXPECT_EQ(test, ring.nr_allocated, 0);
+	KUNIT_EXPECT_FALSE(test, pipe_ring_need_shrink(&ring));
+
+	/* Page under head is kept for the next write */
+	KUNIT_ASSERT_EQ(test, ring_put(&ring, buf, 10), 10);
+	KUNIT_ASSERT_EQ(test, ring_get(&ring, buf, 10), 10);
+	KUNIT_EXPECT_FALSE(test, pipe_ring_need_shrink(&ring));
+	KUNIT_EXPECT_EQ(test, ring.nr_allocated, 1);
+
+	pipe_ring_free(&ring);
+}
+
+/* Wrapped data moves to the start of new ring intact */
+static void ring_resize_test(struct kunit *test)
+{
+	size_t len = 3000;
+	struct pipe_ring ring;
+	u8 *in, *out;
+
+	in = kunit_kmalloc(test, len, GFP_KERNEL);
+	out = kunit_kmalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, in);
+	KUNIT_ASSERT_NOT_NULL(test, out);
+
+	KUNIT_ASSERT_EQ(test, pipe_ring_init(&ring, PAGE_SIZE,
+		numa_node_id()), 0);
+
+	/* Move indices close to ring end, so data wraps */
+	KUNIT_ASSERT_EQ(test, ring_put(&ring, in, PAGE_SIZE - 100),
+		PAGE_SIZE - 100);
+	KUNIT_ASSERT_EQ(test, ring_get(&ring, out, PAGE_SIZE - 100),
+		PAGE_SIZE - 100);
+
+	fill(in, len, 3);
+	KUNIT_ASSERT_EQ(test, ring_put(&ring, in, len), len);
+
+	KUNIT_EXPECT_EQ(test, pipe_ring_resize(&ring, 2048), -EBUSY);
+
+	KUNIT_ASSERT_EQ(test, pipe_ring_resize(&ring, 4 * PAGE_SIZE), 0);
+	KUNIT_EXPECT_EQ(test, ring.size, 4 * PAGE_SIZE);
+	KUNIT_EXPECT_EQ(test, ring.ctl->size, 4 * PAGE_SIZE);
+	KUNIT_EXPECT_EQ(test, ring.nr_pages, 4);
+	KUNIT_EXPECT_EQ(test, pipe_ring_cnt(&ring), len);
+
+	KUNIT_ASSERT_EQ(test, pipe_ring_resize(&ring, PAGE_SIZE), 0);
+	KUNIT_EXPECT_EQ(test, pipe_ring_cnt(&ring), len);
+
+	KUNIT_ASSERT_EQ(test, ring_get(&ring, out, len), len);
+	KUNIT_EXPECT_MEMEQ(test, in, out, len);
+
+	pipe_ring_free(&ring);
+}
+
+static struct kunit_case pipe_ring_cases[] = {
+	KUNIT_CASE(ring_init_test),
+	KUNIT_CASE(ring_wrap_test),
+	KUNIT_CASE(ring_full_test),
+	KUNIT_CASE(ring_shrink_test),
+	KUNIT_CASE(ring_resize_test),
+	{}
+};
+
+static struct kunit_suite pipe_ring_suite = {
+	.name = "pipe_shmipe_ring",
+	.test_cases = pipe_ring_cases,
+};
+
+static kuid_t test_uid(unsigned int n)
+{
+	return KUIDT_INIT(TEST_UID + n);
+}
+
+static void user_get_test(struct kunit *test)
+{
+	struct pipe_user *a, *b, *c, *d;
+
+	a = pipe_user_get(test_uid(0), 0, PAGE_SIZE);
+	KUNIT_ASSERT_NOT_NULL(test, a);
+	KUNIT_EXPECT_TRUE(test, uid_eq(a->uid, test_uid(0)));
+	KUNIT_EXPECT_EQ(test, a->channel, 0);
+	KUNIT_EXPECT_EQ(test, kref_read(&a->count), 1);
+
+	b = pipe_user_get(test_uid(0), 0, PAGE_SIZE);
+	KUNIT_EXPECT_PTR_EQ(test, a, b);
+	KUNIT_EXPECT_EQ(test, kref_read(&a->count), 2);
+
+	c = pipe_user_get(test_uid(0), 1, PAGE_SIZE);
+	d = pipe_user_get(test_uid(1), 0, PAGE_SIZE);
+	KUNIT_ASSERT_NOT_NULL(test, c);
+	KUNIT_ASSERT_NOT_NULL(test, d);
+	KUNIT_EXPECT_PTR_NE(test, a, c);
+	KUNIT_EXPECT_PTR_NE(test, a, d);
+	KUNIT_EXPECT_PTR_NE(test, c, d);
+
+	pipe_user_put(d);
+	pipe_user_put(c);
+	pipe_user_put(b);
+	KUNIT_EXPECT_EQ(test, kref_read(&a->count), 1);
+	pipe_user_put(a);
+}
+
+/* Last put keeps buffer with unread data, the next get revives it */
+static void user_release_test(struct kunit *test)
+{
+	struct pipe_user *usrp;
+	u8 buf[16];
+
+	usrp = pipe_user_get(test_uid(2), 0, PAGE_SIZE);
+	KUNIT_ASSERT_NOT_NULL(test, usrp);
+	KUNIT_EXPECT_EQ(test, usrp->ring.size, PAGE_SIZE);
+
+	fill(buf, sizeof(buf), 5);
+	KUNIT_ASSERT_EQ(test, ring_put(&usrp->ring, buf, sizeof(buf)),
+		sizeof(buf));
+	pipe_user_put(usrp);
+
+	/* Size only applies to new buffers */
+	usrp = pipe_user_get(test_uid(2), 0, 2 * PAGE_SIZE);
+	KUNIT_ASSERT_NOT_NULL(test, usrp);
+	KUNIT_EXPECT_EQ(test, kref_read(&usrp->count), 1);
+	KUNIT_EXPECT_EQ(test, usrp->ring.size, PAGE_SIZE);
+	KUNIT_EXPECT_EQ(test, pipe_ring_cnt(&usrp->ring), sizeof(buf));
+
+	memset(buf, 0, sizeof(buf));
+	KUNIT_ASSERT_EQ(test, ring_get(&usrp->ring, buf, sizeof(buf)),
+		sizeof(buf));
+	pipe_user_put(usrp);
+
+	/* Drained buffer is gone, so this one is new */
+	usrp = pipe_user_get(test_uid(2), 0, 2 * PAGE_SIZE);
+	KUNIT_ASSERT_NOT_NULL(test, usrp);
+	KUNIT_EXPECT_EQ(test, usrp->ring.size, 2 * PAGE_SIZE);
+	KUNIT_EXPECT_EQ(test, pipe_ring_cnt(&usrp->ring), 0);
+	pipe_user_put(usrp);
+}
+
+static struct kunit_case pipe_user_cases[] = {
+	KUNIT_CASE(user_get_test),
+	KUNIT_CASE(user_release_test),
+	{}
+};
+
+static struct kunit_suite pipe_user_suite = {
+	.name = "pipe_shmipe_user",
+	.test_cases = pipe_user_cases,
+};
+
+/*
+ * Writers send 12 byte tokens, a few at a time. Readers hold read_lock
+ * while they check them, so tokens of every writer must come in order.
+ * Token size doesn't divide ring size, so tokens straddle pages and ring
+ * end all the time.
+ */
+struct token {
+	u32 writer;
+	u32 seq;
+	u32 check;
+};
+
+#define TOKEN_SIZE sizeof(struct token)
+
+struct stress {
+	struct kunit *test;
+	struct pipe_ring ring;
+	struct mutex read_lock;
+	struct mutex write_lock;
+	wait_queue_head_t wait;
+
+	unsigned int nr_writers;
+	unsigned int nr_tokens;
+	u32 next[STRESS_MAX_THREADS];
+	atomic_t nr_read;
+	unsigned long deadline;
+
+	atomic_t errors;
+	atomic_t resizes;
+	atomic_t shrinks;
+
+	atomic_t nr_running;
+	struct completion done;
+};
+
+struct stress_thread {
+	struct stress *s;
+	unsigned int id;
+};
+
+static u32 token_check(u32 writer, u32 seq)
+{
+	return (writer * 0x9e3779b9) ^ (seq * 0x85ebca6b);
+}
+
+static bool stress_all_read(struct stress *s)
+{
+	return atomic_read(&s->nr_read) == s->nr_writers * s->nr_tokens;
+}
+
+static bool stress_expired(struct stress *s)
+{
+	if (!time_after(jiffies, s->deadline))
+		return false;
+
+	atomic_inc(&s->errors);
+	return true;
+}
+
+static void stress_exit(struct stress *s)
+{
+	if (atomic_dec_and_test(&s->nr_running))
+		complete(&s->done);
+}
+
+static int stress_writer(void *data)
+{
+	struct stress_thread *t = data;
+	struct stress *s = t->s;
+	struct token tok[STRESS_BATCH];
+	unsigned int seq = 0;
+	unsigned int nr;
+	unsigned int i;
+
+	while (seq < s->nr_tokens && !stress_expired(s)) {
+		nr = min(1 + get_random_u32_below(STRESS_BATCH),
+			s->nr_tokens - seq);
+
+		for (i = 0; i < nr; i++) {
+			tok[i].writer = t->id;
+			tok[i].seq = seq + i;
+			tok[i].check = token_check(t->id, seq + i);
+		}
+
+		mutex_lock(&s->write_lock);
+
+		if (pipe_ring_space(&s->ring) < nr * TOKEN_SIZE) {
+			mutex_unlock(&s->write_lock);
+			wait_event_timeout(s->wait, pipe_ring_space(&s->ring)
+				>= nr * TOKEN_SIZE, STRESS_WAIT);
+			continue;
+		}
+
+		if (ring_put(&s->ring, tok, nr * TOKEN_SIZE)
+			!= nr * TOKEN_SIZE)
+			atomic_inc(&s->errors);
+
+		mutex_unlock(&s->write_lock);
+
+		wake_up_all(&s->wait);
+		seq += nr;
+	}
+
+	stress_exit(s);
+	return 0;
+}
+
+static void stress_check(struct stress *s, struct token *tok)
+{
+	if (tok->writer >= s->nr_writers
+		|| tok->check != token_check(tok->writer, tok->seq)) {
+		atomic_inc(&s->errors);
+		return;
+	}
+
+	if (tok->seq != s->next[tok->writer])
+		atomic_inc(&s->errors);
+
+	s->next[tok->writer] = tok->seq + 1;
+}
+
+/* Drains like pipe_read_iter() does, shrinking ring when it is empty */
+static int stress_reader(void *data)
+{
+	struct stress_thread *t = data;
+	struct stress *s = t->s;
+	struct token tok[STRESS_BATCH];
+	unsigned int nr;
+	unsigned int i;
+
+	while (!stress_all_read(s) && !stress_expired(s)) {
+		mutex_lock(&s->read_lock);
+
+		nr = min_t(unsigned int, pipe_ring_cnt(&s->ring) / TOKEN_SIZE,
+			1 + get_random_u32_below(STRESS_BATCH));
+		if (nr == 0) {
+			mutex_unlock(&s->read_lock);
+			wait_event_timeout(s->wait,
+				pipe_ring_cnt(&s->ring) >= TOKEN_SIZE
+				|| stress_all_read(s), STRESS_WAIT);
+			continue;
+		}
+
+		if (ring_get(&s->ring, tok, nr * TOKEN_SIZE)
+			!= nr * TOKEN_SIZE)
+			atomic_inc(&s->errors);
+
+		for (i = 0; i < nr; i++)
+			stress_check(s, &tok[i]);
+
+		atomic_add(nr, &s->nr_read);
+
+		if (pipe_ring_cnt(&s->ring) == 0
+			&& pipe_ring_need_shrink(&s->ring)
+			&& mutex_trylock(&s->write_lock)) {
+			if (pipe_ring_cnt(&s->ring) == 0) {
+				pipe_ring_shrink(&s->ring);
+				atomic_inc(&s->shrinks);
+			}
+			mutex_unlock(&s->write_lock);
+		}
+
+		mutex_unlock(&s->read_lock);
+
+		wake_up_all(&s->wait);
+	}
+
+	wake_up_all(&s->wait);
+	stress_exit(s);
+	return 0;
+}
+
+/* Resizes ring under traffic with both sides excluded, as ioctl does */
+static int stress_resizer(void *data)
+{
+	static const unsigned int sizes[] = {
+		PAGE_SIZE, 4 * PAGE_SIZE, 2 * PAGE_SIZE, 8 * PAGE_SIZE,
+	};
+	struct stress_thread *t = data;
+	struct stress *s = t->s;
+	unsigned int i = 0;
+	int ret;
+
+	while (!stress_all_read(s) && !stress_expired(s)) {
+		mutex_lock(&s->read_lock);
+		mutex_lock(&s->write_lock);
+
+		ret = pipe_ring_resize(&s->ring, sizes[i % ARRAY_SIZE(sizes)]);
+		i++;
+		if (ret == 0)
+			atomic_inc(&s->resizes);
+		else if (ret != -EBUSY)
+			atomic_inc(&s->errors);
+
+		mutex_unlock(&s->write_lock);
+		mutex_unlock(&s->read_lock);
+
+		wake_up_all(&s->wait);
+		usleep_range(100, 200);
+	}
+
+	stress_exit(s);
+	return 0;
+}
+
+static void ring_stress(struct kunit *test, unsigned int nr_writers,
+	unsigned int nr_readers, bool resize)
+{
+	struct stress_thread *threads;
+	struct task_struct *task;
+	unsigned int nr = 0;
+	struct stress *s;
+	unsigned int i;
+
+	s = kunit_kzalloc(test, sizeof(*s), GFP_KERNEL);
+	threads = kunit_kcalloc(test, 2 * STRESS_MAX_THREADS + 1,
+		sizeof(*threads), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, s);
+	KUNIT_ASSERT_NOT_NULL(test, threads);
+
+	KUNIT_ASSERT_EQ(test, pipe_ring_init(&s->ring, 2 * PAGE_SIZE,
+		numa_node_id()), 0);
+
+	s->test = test;
+	mutex_init(&s->read_lock);
+	mutex_init(&s->write_lock);
+	init_waitqueue_head(&s->wait);
+	s->nr_writers = nr_writers;
+	s->nr_tokens = 20000;
+	s->deadline = jiffies + STRESS_TIMEOUT;
+	init_completion(&s->done);
+
+	/* Held until every thread is started, so none exits early */
+	atomic_set(&s->nr_running, 1);
+
+	for (i = 0; i < nr_writers + nr_readers + resize; i++) {
+		int (*fn)(void *) = stress_resizer;
+
+		if (i < nr_writers)
+			fn = stress_writer;
+		else if (i < nr_writers + nr_readers)
+			fn = stress_reader;
+
+		threads[i].s = s;
+		threads[i].id = i;
+
+		atomic_inc(&s->nr_running);
+		task = kthread_run(fn, &threads[i], "pipe-stress/%u", i);
+		if (IS_ERR(task)) {
+			atomic_dec(&s->nr_running);
+			atomic_inc(&s->errors);
+			/* Tokens of a missing writer never come */
+			s->deadline = jiffies;
+			break;
+		}
+		nr++;
+	}
+
+	stress_exit(s);
+	wait_for_completion(&s->done);
+
+	kunit_info(test, "%u threads, %d tokens, %d resizes, %d shrinks\n",
+		nr, atomic_read(&s->nr_read), atomic_read(&s->resizes),
+		atomic_read(&s->shrinks));
+
+	KUNIT_EXPECT_EQ(test, atomic_read(&s->errors), 0);
+	KUNIT_EXPECT_TRUE(test, stress_all_read(s));
+	KUNIT_EXPECT_EQ(test, pipe_ring_cnt(&s->ring), 0);
+	if (resize)
+		KUNIT_EXPECT_GT(test, atomic_read(&s->resizes), 0);
+
+	pipe_ring_free(&s->ring);
+}
+
+static void stress_spsc_test(struct kunit *test)
+{
+	ring_stress(test, 1, 1, false);
+}
+
+static void stress_mpmc_test(struct kunit *test)
+{
+	ring_stress(test, 4, 4, false);
+}
+
+static void stress_resize_test(struct kunit *test)
+{
+	ring_stress(test, 3, 3, true);
+}
+
+/*
+ * Lookup threads get and put a few buffers over and over. Sometimes they
+ * leave a byte behind, so release keeps the buffer, and sometimes drain
+ * it, so release frees it while others look it up under RCU. Buffer 0 is
+ * held throughout, every get of it must return the same one.
+ */
+#define LOOKUP_USERS 4
+#define LOOKUP_LOOPS 20000
+
+struct lookup {
+	struct pipe_user *held;
+	atomic_t errors;
+	atomic_t nr_running;
+	struct completion done;
+};
+
+static int lookup_thread(void *data)
+{
+	struct lookup *l = data;
+	struct pipe_user *usrp;
+	unsigned int n;
+	unsigned int i;
+	u8 byte = 0;
+
+	for (i = 0; i < LOOKUP_LOOPS; i++) {
+		n = get_random_u32_below(LOOKUP_USERS);
+
+		usrp = pipe_user_get(test_uid(16 + n), n & 1, PAGE_SIZE);
+		if (usrp == NULL) {
+			atomic_inc(&l->errors);
+			continue;
+		}
+
+		if (!uid_eq(usrp->uid, test_uid(16 + n))
+			|| usrp->channel != (n & 1)
+			|| kref_read(&usrp->count) == 0
+			|| (n == 0 && usrp != l->held))
+			atomic_inc(&l->errors);
+
+		switch (get_random_u32_below(4)) {
+		case 0:
+			mutex_lock(&usrp->write_lock);
+			if (pipe_ring_space(&usrp->ring))
+				ring_put(&usrp->ring, &byte, 1);
+			mutex_unlock(&usrp->write_lock);
+			break;
+		case 1:
+			mutex_lock(&usrp->read_lock);
+			while (pipe_ring_cnt(&usrp->ring))
+				ring_get(&usrp->ring, &byte, 1);
+			mutex_unlock(&usrp->read_lock);
+			break;
+		}
+
+		pipe_user_put(usrp);
+
+		if (i % 256 == 0)
+			cond_resched();
+	}
+
+	if (atomic_dec_and_test(&l->nr_running))
+		complete(&l->done);
+	return 0;
+}
+
+static void stress_lookup_test(struct kunit *test)
+{
+	struct pipe_user *usrp;
+	struct task_struct *task;
+	struct lookup *l;
+	unsigned int n;
+	unsigned int i;
+	u8 byte;
+
+	l = kunit_kzalloc(test, sizeof(*l), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, l);
+
+	l->held = pipe_user_get(test_uid(16), 0, PAGE_SIZE);
+	KUNIT_ASSERT_NOT_NULL(test, l->held);
+
+	init_completion(&l->done);
+	atomic_set(&l->nr_running, 1);
+
+	for (i = 0; i < STRESS_MAX_THREADS; i++) {
+		atomic_inc(&l->nr_running);
+		task = kthread_run(lookup_thread, l, "pipe-lookup/%u", i);
+		if (IS_ERR(task)) {
+			atomic_dec(&l->nr_running);
+			atomic_inc(&l->errors);
+			break;
+		}
+	}
+
+	if (atomic_dec_and_test(&l->nr_running))
+		complete(&l->done);
+	wait_for_completion(&l->done);
+
+	KUNIT_EXPECT_EQ(test, atomic_read(&l->errors), 0);
+	KUNIT_EXPECT_EQ(test, kref_read(&l->held->count), 1);
+	pipe_user_put(l->held);
+
+	/* Drain what was left behind, so every buffer is freed */
+	for (n = 0; n < LOOKUP_USERS; n++) {
+		usrp = pipe_user_get(test_uid(16 + n), n & 1, PAGE_SIZE);
+		KUNIT_ASSERT_NOT_NULL(test, usrp);
+		KUNIT_EXPECT_EQ(test, kref_read(&usrp->count), 1);
+		while (pipe_ring_cnt(&usrp->ring))
+			ring_get(&usrp->ring, &byte, 1);
+		pipe_user_put(usrp);
+	}
+}
+
+static struct kunit_case pipe_stress_cases[] = {
+	KUNIT_CASE(stress_spsc_test),
+	KUNIT_CASE(stress_mpmc_test),
+	KUNIT_CASE(stress_resize_test),
+	KUNIT_CASE(stress_lookup_test),
+	{}
+};
+
+static struct kunit_suite pipe_stress_suite = {
+	.name = "pipe_shmipe_stress",
+	.test_cases = pipe_stress_cases,
+};
+
+static u64 ns_per_op(ktime_t start, unsigned long nr)
+{
+	return div_u64(ktime_to_ns(ktime_sub(ktime_get(), start)), nr);
+}
+
+/* Write and read back one chunk per iteration, through iterators */
+static void bench_copy_test(struct kunit *test)
+{
+	static const size_t sizes[] = { 64, 512, 4096, 32768 };
+	struct pipe_ring ring;
+	unsigned long iters;
+	unsigned long n;
+	ktime_t start;
+	unsigned int i;
+	u8 *buf;
+	u64 ns;
+
+	buf = kunit_kzalloc(test, sizes[ARRAY_SIZE(sizes) - 1], GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+
+	KUNIT_ASSERT_EQ(test, pipe_ring_init(&ring, 64 * 1024,
+		numa_node_id()), 0);
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		iters = (64UL << 20) / sizes[i];
+
+		start = ktime_get();
+		for (n = 0; n < iters; n++) {
+			ring_put(&ring, buf, sizes[i]);
+			ring_get(&ring, buf, sizes[i]);
+		}
+		ns = ns_per_op(start, iters);
+
+		kunit_info(test, "iter copy %zu bytes: %llu ns, %llu MB/s\n",
+			sizes[i], ns, ns ? div_u64(sizes[i] * 1000, ns) : 0);
+
+		start = ktime_get();
+		for (n = 0; n < iters; n++) {
+			pipe_ring_memcpy_in(&ring, n * sizes[i] % ring.size,
+				buf, sizes[i]);
+			pipe_ring_memcpy_out(&ring, buf,
+				n * sizes[i] % ring.size, sizes[i]);
+		}
+		ns = ns_per_op(start, iters);
+
+		kunit_info(test, "memcpy %zu bytes: %llu ns, %llu MB/s\n",
+			sizes[i], ns, ns ? div_u64(sizes[i] * 1000, ns) : 0);
+	}
+
+	pipe_ring_free(&ring);
+}
+
+/*
+ * Get and put of a live buffer is the RCU fast path open() takes. Getting
+ * a buffer nobody has creates it and putting it frees it again.
+ */
+static void bench_lookup_test(struct kunit *test)
+{
+	unsigned long iters = 1000000;
+	struct pipe_user *held;
+	struct pipe_user *usrp;
+	unsigned long n;
+	ktime_t start;
+
+	held = pipe_user_get(test_uid(32), 0, PAGE_SIZE);
+	KUNIT_ASSERT_NOT_NULL(test, held);
+
+	start = ktime_get();
+	for (n = 0; n < iters; n++)
+		pipe_user_put(pipe_user_get(test_uid(32), 0, PAGE_SIZE));
+	kunit_info(test, "lookup hit: %llu ns\n", ns_per_op(start, iters));
+
+	pipe_user_put(held);
+
+	iters = 10000;
+
+	start = ktime_get();
+	for (n = 0; n < iters; n++) {
+		usrp = pipe_user_get(test_uid(33), 0, PAGE_SIZE);
+		KUNIT_ASSERT_NOT_NULL(test, usrp);
+		pipe_user_put(usrp);
+	}
+	kunit_info(test, "create and free: %llu ns\n",
+		ns_per_op(start, iters));
+}
+
+static struct kunit_case pipe_bench_cases[] = {
+	KUNIT_CASE_SLOW(bench_copy_test),
+	KUNIT_CASE_SLOW(bench_lookup_test),
+	{}
+};
+
+static struct kunit_suite pipe_bench_suite = {
+	.name = "pipe_shmipe_bench",
+	.test_cases = pipe_bench_cases,
+};
+
+kunit_test_suites(&pipe_ring_suite, &pipe_user_suite, &pipe_stress_suite,
+	&pipe_bench_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("KUnit tests for pipe-shmipe");
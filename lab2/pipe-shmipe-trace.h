@@ -0,0 +1,96 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pipe_shmipe
+
+#if !defined(_PIPE_SHMIPE_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _PIPE_SHMIPE_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/* Data moved through buffer, cnt is buffer occupancy afterwards */
+DECLARE_EVENT_CLASS(pipe_shmipe_xfer,
+	TP_PROTO(u32 uid, unsigned int channel, size_t bytes, unsigned int cnt),
+	TP_ARGS(uid, channel, bytes, cnt),
+
+	TP_STRUCT__entry(
+		__field(u32, uid)
+		__field(unsigned int, channel)
+		__field(size_t, bytes)
+		__field(unsigned int, cnt)
+	),
+
+	TP_fast_assign(
+		__entry->uid = uid;
+		__entry->channel = channel;
+		__entry->bytes = bytes;
+		__entry->cnt = cnt;
+	),
+
+	TP_printk("uid=%u channel=%u bytes=%zu cnt=%u",
+		__entry->uid, __entry->channel, __entry->bytes, __entry->cnt)
+);
+
+DEFINE_EVENT(pipe_shmipe_xfer, pipe_shmipe_read,
+	TP_PROTO(u32 uid, unsigned int channel, size_t bytes, unsigned int cnt),
+	TP_ARGS(uid, channel, bytes, cnt)
+);
+
+DEFINE_EVENT(pipe_shmipe_xfer, pipe_shmipe_write,
+	TP_PROTO(u32 uid, unsigned int channel, size_t bytes, unsigned int cnt),
+	TP_ARGS(uid, channel, bytes, cnt)
+);
+
+/* Task slept for ns waiting for data (write = 0) or space (write = 1) */
+TRACE_EVENT(pipe_shmipe_block,
+	TP_PROTO(u32 uid, unsigned int channel, bool write, u64 ns),
+	TP_ARGS(uid, channel, write, ns),
+
+	TP_STRUCT__entry(
+		__field(u32, uid)
+		__field(unsigned int, channel)
+		__field(bool, write)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->uid = uid;
+		__entry->channel = channel;
+		__entry->write = write;
+		__entry->ns = ns;
+	),
+
+	TP_printk("uid=%u channel=%u side=%s ns=%llu",
+		__entry->uid, __entry->channel,
+		__entry->write ? "write" : "read", __entry->ns)
+);
+
+/* Sleeping readers (write = 0) or writers (write = 1) are woken up */
+TRACE_EVENT(pipe_shmipe_wake,
+	TP_PROTO(u32 uid, unsigned int channel, bool write, unsigned int cnt),
+	TP_ARGS(uid, channel, write, cnt),
+
+	TP_STRUCT__entry(
+		__field(u32, uid)
+		__field(unsigned int, channel)
+		__field(bool, write)
+		__field(unsigned int, cnt)
+	),
+
+	TP_fast_assign(
+		__entry->uid = uid;
+		__entry->channel = channel;
+		__entry->write = write;
+		__entry->cnt = cnt;
+	),
+
+	TP_printk("uid=%u channel=%u side=%s cnt=%u",
+		__entry->uid, __entry->channel,
+		__entry->write ? "write" : "read", __entry->cnt)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pipe-shmipe-trace
+#include <trace/define_trace.h>
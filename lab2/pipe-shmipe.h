@@ -0,0 +1,107 @@
+#ifndef _PIPE_SHMIPE_H_
+#define _PIPE_SHMIPE_H_
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Layout of pipe mapping: control page at offset 0, ring data right after
+ * it at offset of one page. Map both with a single shared mmap() of
+ * page size + ctl->size bytes. Ring can't be resized while it is mapped.
+ *
+ * Ring follows the same rules as the driver: indices are kept in range
+ * [0, size), producer only moves head and consumer only moves tail. Write
+ * data before storing head with release semantics, read head with acquire
+ * semantics before reading data (and the same for tail in reverse).
+ *
+ * Driver sets read_waiters/write_waiters before a task goes to sleep
+ * waiting for data/space and keeps it set while any task of that side
+ * sleeps. After moving an index, issue a full memory barrier and call
+ * PIPE_SHMIPE_WAKE if the other side's flag is set.
+ */
+struct pipe_shmipe_ctl {
+	__u32 head;
+	__u32 read_waiters;
+	__u32 __pad0[14];
+
+	__u32 tail;
+	__u32 write_waiters;
+	__u32 __pad1[14];
+
+	__u32 size;
+};
+
+/*
+ * Readiness thresholds for poll(), similar to SO_RCVLOWAT/SO_SNDLOWAT.
+ * Pipe is readable when it holds at least low bytes and writable when it
+ * holds less than high bytes. Both are within [1, size - 1], defaults are
+ * 1 and size - 1.
+ *
+ * The same thresholds decide when sleeping readers and writers are woken
+ * up. Data below low is delivered to sleeping readers only after flush
+ * timeout (PIPE_SHMIPE_SET_FLUSH), poll() then reports it as readable
+ * until the next read. With timeout 0 they are woken at the end of every
+ * write, and low only affects poll().
+ */
+struct pipe_shmipe_wmark {
+	__u32 low;
+	__u32 high;
+};
+
+/*
+ * In message mode every write() is stored as one record, and every read()
+ * returns at most one record, discarding what doesn't fit. In ring and in
+ * PIPE_SHMIPE_READ_BATCH output a record is its __u32 length in host byte
+ * order followed by data, records go back to back with no padding.
+ */
+#define PIPE_SHMIPE_MODE_STREAM	0
+#define PIPE_SHMIPE_MODE_MSG	1
+
+/*
+ * Read as many whole records as fit into buffer buf of len bytes, but no
+ * more than max_msgs of them (0 means no limit). Number of records read
+ * is returned in nr_msgs, total bytes as ioctl result.
+ */
+struct pipe_shmipe_batch {
+	__u64 buf;
+	__u32 len;
+	__u32 max_msgs;
+	__u32 nr_msgs;
+	__u32 __pad;
+};
+
+#define PIPE_SHMIPE_IOC_MAGIC 0xb7
+
+/* Sleep until there is data in ring */
+#define PIPE_SHMIPE_WAIT_DATA	_IO(PIPE_SHMIPE_IOC_MAGIC, 1)
+/* Sleep until there is space in ring */
+#define PIPE_SHMIPE_WAIT_SPACE	_IO(PIPE_SHMIPE_IOC_MAGIC, 2)
+/* Wake up tasks sleeping on both sides after moving head or tail */
+#define PIPE_SHMIPE_WAKE	_IO(PIPE_SHMIPE_IOC_MAGIC, 3)
+/* Set/get poll() readiness thresholds */
+#define PIPE_SHMIPE_SET_WMARK	_IOW(PIPE_SHMIPE_IOC_MAGIC, 4, \
+	struct pipe_shmipe_wmark)
+#define PIPE_SHMIPE_GET_WMARK	_IOR(PIPE_SHMIPE_IOC_MAGIC, 5, \
+	struct pipe_shmipe_wmark)
+/*
+ * Set ring size to argument rounded up to power of 2, like F_SETPIPE_SZ.
+ * Returns new size, fails with EBUSY if data doesn't fit or ring is mapped.
+ */
+#define PIPE_SHMIPE_SET_SIZE	_IO(PIPE_SHMIPE_IOC_MAGIC, 6)
+/* Returns ring size */
+#define PIPE_SHMIPE_GET_SIZE	_IO(PIPE_SHMIPE_IOC_MAGIC, 7)
+/*
+ * Set/get PIPE_SHMIPE_MODE_*, pipe must be empty and not mapped to change
+ * mode. Opening with O_DIRECT selects message mode too, it fails with
+ * EBUSY if the channel is in stream mode and has other openers.
+ */
+#define PIPE_SHMIPE_SET_MODE	_IO(PIPE_SHMIPE_IOC_MAGIC, 8)
+#define PIPE_SHMIPE_GET_MODE	_IO(PIPE_SHMIPE_IOC_MAGIC, 9)
+/* Read batch of records in message mode */
+#define PIPE_SHMIPE_READ_BATCH	_IOWR(PIPE_SHMIPE_IOC_MAGIC, 10, \
+	struct pipe_shmipe_batch)
+/* Set/get reader flush timeout in ms, at most 1000, 0 wakes on every write */
+#define PIPE_SHMIPE_SET_FLUSH	_IO(PIPE_SHMIPE_IOC_MAGIC, 11)
+#define PIPE_SHMIPE_GET_FLUSH	_IO(PIPE_SHMIPE_IOC_MAGIC, 12)
+
+#endif
@@ -0,0 +1,263 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/hashtable.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/topology.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <kunit/visibility.h>
+
+#include "pipe-user.h"
+#include "pipe-shmipe-trace.h"
+
+#define USER_HASH_BITS 8
+
+static struct kmem_cache *user_cache;
+static struct dentry *pipe_debugfs;
+
+/*
+ * Users are looked up under RCU. Insertion, removal and reviving of an
+ * idle entry (count == 0) are serialized by user_lock.
+ */
+static DEFINE_HASHTABLE(user_table, USER_HASH_BITS);
+static DEFINE_MUTEX(user_lock);
+
+static void pipe_debugfs_add(struct pipe_user *);
+
+static void pipe_flush_timer(struct timer_list *t)
+{
+	struct pipe_user *usrp = from_timer(usrp, t, flush_timer);
+
+	WRITE_ONCE(usrp->flush_expired, true);
+	this_cpu_inc(usrp->stats->read_wakeups);
+	trace_pipe_shmipe_wake(__kuid_val(usrp->uid), usrp->channel, false,
+		pipe_ring_cnt(&usrp->ring));
+	wake_up(&usrp->read_wait);
+}
+
+/* Every (uid, channel) pair gets its own buffer */
+static u64 pipe_user_key(kuid_t uid, unsigned int channel)
+{
+	return (u64)channel << 32 | __kuid_val(uid);
+}
+
+static bool
+pipe_user_match(struct pipe_user *usrp, kuid_t uid, unsigned int channel)
+{
+	return uid_eq(uid, usrp->uid) && channel == usrp->channel;
+}
+
+/* Everything is placed on node of the first opener */
+static struct pipe_user *
+pipe_user_alloc(kuid_t uid, unsigned int channel, unsigned int size)
+{
+	struct pipe_user *usrp;
+	int node = numa_node_id();
+
+	usrp = kmem_cache_alloc_node(user_cache, GFP_KERNEL, node);
+	if (usrp == NULL)
+		return NULL;
+
+	if (pipe_ring_init(&usrp->ring, size, node))
+		goto err_ring;
+
+	usrp->stats = alloc_percpu(struct pipe_stats);
+	if (usrp->stats == NULL)
+		goto err_stats;
+
+	usrp->read_nid = node;
+	usrp->read_streak = 0;
+	mutex_init(&usrp->shape_lock);
+	atomic_set(&usrp->mapped, 0);
+	usrp->uid = uid;
+	usrp->channel = channel;
+	kref_init(&usrp->count);
+	mutex_init(&usrp->read_lock);
+	mutex_init(&usrp->write_lock);
+	usrp->read_sleepers = 0;
+	usrp->write_sleepers = 0;
+	init_waitqueue_head(&usrp->read_wait);
+	init_waitqueue_head(&usrp->write_wait);
+	usrp->low_wmark = 1;
+	usrp->high_wmark = size - 1;
+	usrp->flush_timeout = 0;
+	timer_setup(&usrp->flush_timer, pipe_flush_timer, 0);
+	usrp->flush_expired = false;
+	usrp->msg_mode = false;
+	usrp->debugfs = NULL;
+
+	return usrp;
+
+err_stats:
+	pipe_ring_free(&usrp->ring);
+err_ring:
+	kmem_cache_free(user_cache, usrp);
+	return NULL;
+}
+
+static void pipe_user_free(struct pipe_user *usrp)
+{
+	timer_shutdown_sync(&usrp->flush_timer);
+	free_percpu(usrp->stats);
+	pipe_ring_free(&usrp->ring);
+}
+
+static void pipe_user_free_rcu(struct rcu_head *rcu)
+{
+	kmem_cache_free(user_cache, container_of(rcu, struct pipe_user, rcu));
+}
+
+/*
+ * Take a reference to buffer of (uid, channel), creating it with a ring of
+ * size bytes if there is none. Returns NULL if out of memory.
+ */
+struct pipe_user *
+pipe_user_get(kuid_t uid, unsigned int channel, unsigned int size)
+{
+	u64 key = pipe_user_key(uid, channel);
+	struct pipe_user *usrp;
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(user_table, usrp, node, key) {
+		if (pipe_user_match(usrp, uid, channel)
+			&& kref_get_unless_zero(&usrp->count)) {
+			rcu_read_unlock();
+			return usrp;
+		}
+	}
+	rcu_read_unlock();
+
+	/* Slow path: revive idle buffer with leftover data or create one */
+
+	mutex_lock(&user_lock);
+
+	hash_for_each_possible(user_table, usrp, node, key) {
+		if (pipe_user_match(usrp, uid, channel)) {
+			if (!kref_get_unless_zero(&usrp->count))
+				kref_init(&usrp->count);
+			goto out;
+		}
+	}
+
+	usrp = pipe_user_alloc(uid, channel, size);
+	if (usrp != NULL) {
+		hash_add_rcu(user_table, &usrp->node, key);
+		pipe_debugfs_add(usrp);
+	}
+
+out:
+	mutex_unlock(&user_lock);
+
+	return usrp;
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_user_get);
+
+/* Called with user_lock held, releases it */
+static void pipe_user_release(struct kref *kref)
+{
+	struct pipe_user *usrp = container_of(kref, struct pipe_user, count);
+
+	/* Keep unread data for the next task of this user */
+	if (pipe_ring_cnt(&usrp->ring) > 0) {
+		mutex_unlock(&user_lock);
+		return;
+	}
+
+	/* Under user_lock, so a new entry can't reuse the name before */
+	debugfs_remove(usrp->debugfs);
+	hash_del_rcu(&usrp->node);
+	mutex_unlock(&user_lock);
+
+	/* Buffer is never touched by RCU readers, only uid and count are */
+	pipe_user_free(usrp);
+	call_rcu(&usrp->rcu, pipe_user_free_rcu);
+}
+
+void pipe_user_put(struct pipe_user *usrp)
+{
+	kref_put_mutex(&usrp->count, pipe_user_release, &user_lock);
+}
+EXPORT_SYMBOL_IF_KUNIT(pipe_user_put);
+
+static int pipe_stats_show(struct seq_file *m, void *v)
+{
+	struct pipe_user *usrp = m->private;
+	struct pipe_stats sum = {};
+	u64 *dst = (u64 *)&sum;
+	unsigned int i;
+	int cpu;
+
+	/* All fields are u64, sum them up as an array */
+	for_each_possible_cpu(cpu) {
+		u64 *src = (u64 *)per_cpu_ptr(usrp->stats, cpu);
+
+		for (i = 0; i < sizeof(sum) / sizeof(u64); i++)
+			dst[i] += src[i];
+	}
+
+	seq_printf(m, "size: %u\n", READ_ONCE(usrp->ring.size));
+	seq_printf(m, "pages: %u\n", READ_ONCE(usrp->ring.nr_allocated));
+	seq_printf(m, "cnt: %u\n", pipe_ring_cnt(&usrp->ring));
+	seq_printf(m, "reads: %llu\n", sum.reads);
+	seq_printf(m, "read_bytes: %llu\n", sum.read_bytes);
+	seq_printf(m, "writes: %llu\n", sum.writes);
+	seq_printf(m, "write_bytes: %llu\n", sum.write_bytes);
+	seq_printf(m, "read_wakeups: %llu\n", sum.read_wakeups);
+	seq_printf(m, "write_wakeups: %llu\n", sum.write_wakeups);
+	seq_printf(m, "coalesced_wakeups: %llu\n", sum.coalesced_wakeups);
+
+	seq_puts(m, "block_us: read write\n");
+	for (i = 0; i < BLOCK_HIST_BUCKETS; i++)
+		seq_printf(m, "%llu: %llu %llu\n", i ? 1ULL << (i - 1) : 0,
+			sum.read_block_hist[i], sum.write_block_hist[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pipe_stats);
+
+/* Called with user_lock held, failure only costs statistics */
+static void pipe_debugfs_add(struct pipe_user *usrp)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "%u.%u", __kuid_val(usrp->uid),
+		usrp->channel);
+	usrp->debugfs = debugfs_create_file(name, 0400, pipe_debugfs, usrp,
+		&pipe_stats_fops);
+}
+
+int pipe_users_init(void)
+{
+	user_cache = KMEM_CACHE(pipe_user, SLAB_HWCACHE_ALIGN | SLAB_ACCOUNT);
+	if (user_cache == NULL)
+		return -ENOMEM;
+
+	pipe_debugfs = debugfs_create_dir("pipe-shmipe", NULL);
+
+	return 0;
+}
+
+/* Drop users left with unread data, nobody has the device open */
+void pipe_users_exit(void)
+{
+	struct pipe_user *usrp;
+	struct hlist_node *tmp;
+	int bkt;
+
+	debugfs_remove_recursive(pipe_debugfs);
+
+	hash_for_each_safe(user_table, bkt, tmp, usrp, node) {
+		hash_del(&usrp->node);
+		pipe_user_free(usrp);
+		kmem_cache_free(user_cache, usrp);
+	}
+
+	/* Wait for users released with call_rcu() */
+	rcu_barrier();
+	kmem_cache_destroy(user_cache);
+}
@@ -0,0 +1,116 @@
+#ifndef _PIPE_USER_H_
+#define _PIPE_USER_H_
+
+#include <linux/types.h>
+#include <linux/uidgid.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/timer.h>
+#include <linux/rcupdate.h>
+
+#include "pipe-ring.h"
+
+#define BLOCK_HIST_BUCKETS 24
+
+/*
+ * Per-CPU, so the hot path never bounces a shared cache line. Summed up
+ * only when read through debugfs. Blocking time histograms are log2 of
+ * microseconds: bucket 0 is below 1us, bucket n is [2^(n-1), 2^n) us.
+ */
+struct pipe_stats {
+	u64 reads;
+	u64 read_bytes;
+	u64 writes;
+	u64 write_bytes;
+	u64 read_wakeups;
+	u64 write_wakeups;
+	u64 coalesced_wakeups;
+	u64 read_block_hist[BLOCK_HIST_BUCKETS];
+	u64 write_block_hist[BLOCK_HIST_BUCKETS];
+};
+
+struct pipe_user {
+	kuid_t uid;
+	unsigned int channel;
+
+	/*
+	 * Task count acessing driver for current user. Drops to zero when
+	 * the last task closes the pipe, but the entry stays hashed while
+	 * there is unread data in the buffer.
+	 */
+	struct kref count;
+
+	/*
+	 * Control page is mapped at offset 0 into tasks calling mmap(), ring
+	 * pages follow it. Writer allocates pages with write_lock held, pages
+	 * are freed and size is changed only with both side locks and
+	 * shape_lock held. mmap() takes only shape_lock, it runs under
+	 * mmap_lock, which side lock holders take when copies fault. While
+	 * ring is mapped all pages are present and stay in place.
+	 */
+	struct pipe_ring ring;
+	struct mutex shape_lock;
+	atomic_t mapped;
+
+	/*
+	 * Ring pages are allocated on node of the first opener. With
+	 * numa_migrate it follows reader: after NUMA_MIGRATE_READS reads in a
+	 * row from another node new pages come from there, and old ones are
+	 * replaced as ring drains. Reader tracks it with read_lock held.
+	 */
+	int read_nid;
+	unsigned int read_streak;
+
+	/*
+	 * Serialize tasks on the same side of the pipe. Reader and writer
+	 * never take the same lock, so a single reader and a single writer
+	 * run lockless against each other and these mutexes stay
+	 * uncontended. Lock is dropped while waiting for data or space,
+	 * sleepers count tasks doing so and is protected by it.
+	 */
+	struct mutex read_lock;
+	struct mutex write_lock;
+	unsigned int read_sleepers;
+	unsigned int write_sleepers;
+
+	/* Readers sleep until there is data, writers until there is space */
+	wait_queue_head_t read_wait;
+	wait_queue_head_t write_wait;
+
+	/*
+	 * Readiness thresholds: readable when buffer holds at least low_wmark
+	 * bytes, writable when it holds less than high_wmark. Used both by
+	 * poll() and to decide when a sleeping side is woken up, so small
+	 * writes don't bounce reader awake every time. If data stays below
+	 * low_wmark, readers are woken flush_timeout ms after a write anyway,
+	 * or at the end of every write if it is 0. Once the timer fires,
+	 * poll() reports any data as readable until the next read.
+	 */
+	unsigned int low_wmark;
+	unsigned int high_wmark;
+	unsigned int flush_timeout;
+	struct timer_list flush_timer;
+	bool flush_expired;
+
+	/*
+	 * In message mode ring holds records: u32 length followed by data.
+	 * Changed only on empty pipe with both side locks held.
+	 */
+	bool msg_mode;
+
+	struct pipe_stats __percpu *stats;
+	struct dentry *debugfs;
+
+	struct hlist_node node;
+	struct rcu_head rcu;
+};
+
+int pipe_users_init(void);
+void pipe_users_exit(void);
+
+struct pipe_user *
+pipe_user_get(kuid_t uid, unsigned int channel, unsigned int size);
+void pipe_user_put(struct pipe_user *usrp);
+
+#endif
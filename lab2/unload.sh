@@ -2,5 +2,5 @@
 
 module="pipe-shmipe"
 
-rm /dev/$module
-rmmod $module
\ No newline at end of file
+rm -f /dev/$module /dev/$module[0-9]*
+rmmod $module
@@ -1,5 +1,4 @@
 #include <stdio.h>
-#include <unistd.h>
 #include "workqueue.h"
 
 void handler(void *data)
@@ -7,22 +6,60 @@ void handler(void *data)
 	printf("%s", (char *)data);
 }
 
+struct message {
+	struct work work;
+	const char *text;
+};
+
+void message_handler(struct work *work)
+{
+	struct message *msg = container_of(work, struct message, work);
+
+	printf("%s", msg->text);
+}
+
 int main(void)
 {
-	struct workqueue wq1, wq2;
+	struct workqueue wq1, wq2, wq3, wq4, wq5;
+	struct message msg = { .text = "embedded work in WQ2\n" };
+	void *batch[] = {
+		"batch string 1 in WQ1\n",
+		"batch string 2 in WQ1\n",
+		"batch string 3 in WQ1\n",
+	};
 
 	wq_init(&wq1);
 	wq_init(&wq2);
+	wq_init_pool(&wq3, 4, false);
+	wq_init_percpu(&wq4);
+	wq_init_managed(&wq5, 1, 4);
 
 	wq_add(&wq1, handler, "string 1 in WQ1\n");
 	wq_add(&wq1, handler, "string 2 in WQ1\n");
 	wq_add(&wq1, handler, "string 3 in WQ1\n");
 	wq_add(&wq1, handler, "string 4 in WQ1\n");
+	wq_add_batch(&wq1, handler, batch, 3);
 
 	wq_add(&wq2, handler, "string 1 in WQ2\n");
 	wq_add(&wq2, handler, "string 2 in WQ2\n");
 
-	sleep(1);
+	wq_init_work(&msg.work, message_handler);
+	wq_queue_work(&wq2, &msg.work);
+
+	wq_add(&wq3, handler, "string 1 in WQ3, any order\n");
+	wq_add(&wq3, handler, "string 2 in WQ3, any order\n");
+	wq_add(&wq3, handler, "string 3 in WQ3, any order\n");
+
+	wq_add(&wq4, handler, "string 1 in WQ4, on this CPU\n");
+	wq_add_on(&wq4, 0, handler, "string 2 in WQ4, on CPU 0\n");
+
+	wq_add(&wq5, handler, "string 1 in WQ5, managed\n");
+
+	wq_destroy(&wq1);
+	wq_destroy(&wq2);
+	wq_destroy(&wq3);
+	wq_destroy(&wq4);
+	wq_destroy(&wq5);
 
 	return 0;
 }
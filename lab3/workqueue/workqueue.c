@@ -1,66 +1,1820 @@
+#define _GNU_SOURCE
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "workqueue.h"
 
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#else
+	atomic_signal_fence(memory_order_seq_cst);
+#endif
+}
+
+/* Timeout is relative, NULL waits forever */
+static void futex_wait(atomic_uint *addr, unsigned int val,
+	const struct timespec *timeout)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr, int nr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+static void spin_lock(atomic_flag *lock)
+{
+	while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire))
+		sched_yield();
+}
+
+static bool spin_trylock(atomic_flag *lock)
+{
+	return !atomic_flag_test_and_set_explicit(lock, memory_order_acquire);
+}
+
+static void spin_unlock(atomic_flag *lock)
+{
+	atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
+/* Per-CPU worker running on this thread, if any */
+static _Thread_local struct wq_cpu *this_cpu;
+
+/*
+ * Free tasks this thread took off queue with id. Popping one task at a
+ * time with compare-and-exchange is open to ABA: the task may be popped,
+ * run and pushed back between reading its free_next and the exchange.
+ * Taking the whole list with a plain exchange is not, and then the list
+ * is private. Tasks of another queue are freed rather than pushed back,
+ * since that queue may be gone.
+ */
+struct task_cache {
+	unsigned long id;
+	struct task *list;
+};
+
+static _Thread_local struct task_cache task_cache;
+static _Thread_local bool task_cache_registered;
+static pthread_key_t task_cache_key;
+static pthread_once_t task_cache_once = PTHREAD_ONCE_INIT;
+static atomic_ulong wq_next_id;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Clock is only read while some timer is armed */
+static bool wq_timers_due(struct workqueue *wq)
+{
+	uint64_t next = atomic_load_explicit(&wq->next_timer,
+		memory_order_relaxed);
+
+	return next != UINT64_MAX && next <= now_ms();
+}
+
+static void wq_run_timers(struct workqueue *wq);
+static void wq_need_worker(struct workqueue *wq);
+static bool wq_retire(struct workqueue *wq);
+
+/*
+ * Append chain of items already linked from first to last. It becomes
+ * reachable only after it is linked, release publishes all of it at once.
+ */
+static void lane_push_chain(struct wq_lane *lane, struct work *first,
+	struct work *last)
+{
+	struct work *prev;
+
+	atomic_store_explicit(&last->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&lane->tail, last,
+		memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, first, memory_order_release);
+}
+
+static void lane_push(struct wq_lane *lane, struct work *work)
+{
+	lane_push_chain(lane, work, work);
+}
+
+static void lanes_init(struct wq_lane *lanes)
+{
+	struct wq_lane *lane;
+	unsigned int prio;
+
+	for (prio = 0; prio < WQ_NR_PRIO; prio++) {
+		lane = &lanes[prio];
+		atomic_init(&lane->stub.next, NULL);
+		atomic_init(&lane->tail, &lane->stub);
+		lane->head = &lane->stub;
+		lane->starved = 0;
+	}
+}
+
+/* Owner only, fails if the deque is full */
+static bool deque_push(struct wq_deque *dq, struct work *work)
+{
+	long b = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+	long t = atomic_load_explicit(&dq->top, memory_order_acquire);
+
+	if (b - t >= WQ_DEQUE_SIZE)
+		return false;
+
+	atomic_store_explicit(&dq->buf[b & (WQ_DEQUE_SIZE - 1)], work,
+		memory_order_relaxed);
+	atomic_store_explicit(&dq->bottom, b + 1, memory_order_release);
+
+	return true;
+}
+
+/*
+ * Owner only, takes the newest item. Full fence orders taking the slot
+ * against reading top, so that owner and thief can't both get the last
+ * item: whoever moves top first wins it.
+ */
+static struct work *deque_pop(struct wq_deque *dq)
+{
+	long b = atomic_load_explicit(&dq->bottom, memory_order_relaxed) - 1;
+	struct work *work = NULL;
+	long t;
+
+	atomic_store_explicit(&dq->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	t = atomic_load_explicit(&dq->top, memory_order_relaxed);
+
+	if (t <= b) {
+		work = atomic_load_explicit(&dq->buf[b & (WQ_DEQUE_SIZE - 1)],
+			memory_order_relaxed);
+		if (t != b)
+			return work;
+
+		if (!atomic_compare_exchange_strong_explicit(&dq->top, &t,
+				t + 1, memory_order_seq_cst,
+				memory_order_relaxed))
+			work = NULL;
+	}
+
+	atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+
+	return work;
+}
+
+/* Takes the oldest item, NULL if there is none or we lost the race */
+static struct work *deque_steal(struct wq_deque *dq)
+{
+	long t = atomic_load_explicit(&dq->top, memory_order_acquire);
+	struct work *work;
+	long b;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&dq->bottom, memory_order_acquire);
+	if (t >= b)
+		return NULL;
+
+	work = atomic_load_explicit(&dq->buf[t & (WQ_DEQUE_SIZE - 1)],
+		memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&dq->top, &t, t + 1,
+			memory_order_seq_cst, memory_order_relaxed))
+		return NULL;
+
+	return work;
+}
+
+static bool deque_has_work(struct wq_deque *dq)
+{
+	return atomic_load(&dq->top) < atomic_load(&dq->bottom);
+}
+
+/* Mark nr items of color done, waking up flushers once it drains */
+static void wq_done(struct workqueue *wq, unsigned int color, long nr)
+{
+	if (atomic_fetch_sub(&wq->in_flight[color], nr) != nr)
+		return;
+
+	if (atomic_load(&wq->flushers) == 0)
+		return;
+
+	pthread_mutex_lock(&wq->done_lock);
+	pthread_cond_broadcast(&wq->done);
+	pthread_mutex_unlock(&wq->done_lock);
+}
+
+/* Count nr items about to be submitted, returns their color */
+static unsigned int wq_begin(struct workqueue *wq, long nr)
+{
+	unsigned int color;
+
+	while (1) {
+		color = atomic_load(&wq->color);
+		atomic_fetch_add(&wq->in_flight[color], nr);
+
+		if (atomic_load(&wq->color) == color)
+			return color;
+
+		/* Raced with wq_flush(), which may have missed us already */
+		wq_done(wq, color, nr);
+	}
+}
+
+/*
+ * Wake up to nr parked workers, the one of c first and then those of the
+ * following CPUs, which come to steal. Returns false if nobody is parked.
+ */
+static bool wq_wake_parked(struct workqueue *wq, struct wq_cpu *c,
+	unsigned int nr)
+{
+	unsigned int first;
+	unsigned int i;
+
+	if (atomic_load(&wq->nr_parked) == 0)
+		return false;
+
+	if (nr > wq->max_threads)
+		nr = wq->max_threads;
+
+	if (wq->cpus == NULL) {
+		atomic_fetch_add(&wq->wake_seq, 1);
+		futex_wake(&wq->wake_seq, nr);
+		return true;
+	}
+
+	first = c != NULL ? c - wq->cpus : 0;
+	for (i = 0; i < wq->nr_cpus && nr > 0; i++) {
+		c = &wq->cpus[(first + i) % wq->nr_cpus];
+		if (!atomic_load(&c->parked))
+			continue;
+
+		atomic_fetch_add(&c->wake_seq, 1);
+		futex_wake(&c->wake_seq, 1);
+		nr--;
+	}
+
+	return true;
+}
+
+/*
+ * Called after publishing nr items to c, NULL if they went to the shared
+ * lanes. Full fence orders publishing against reading nr_parked, pairs
+ * with the one in wq_park() and the decrement in wq_retire(). Managed
+ * pool with nobody to wake may start a new worker.
+ */
+static void wq_wake(struct workqueue *wq, struct wq_cpu *c, unsigned int nr)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!wq_wake_parked(wq, c, nr) && wq->managed)
+		wq_need_worker(wq);
+}
+
+/* Wake up every worker, stopping must be set so that they don't park again */
+static void wq_wake_all(struct workqueue *wq)
+{
+	unsigned int i;
+
+	atomic_fetch_add(&wq->wake_seq, 1);
+	futex_wake(&wq->wake_seq, INT_MAX);
+
+	for (i = 0; i < wq->nr_cpus; i++) {
+		atomic_fetch_add(&wq->cpus[i].wake_seq, 1);
+		futex_wake(&wq->cpus[i].wake_seq, 1);
+	}
+}
+
+/* Stub is the tail only when everything pushed has been taken */
+static bool lane_has_work(struct wq_lane *lane)
+{
+	return atomic_load(&lane->tail) != &lane->stub;
+}
+
+static bool lanes_has_work(struct wq_lane *lanes)
+{
+	unsigned int prio;
+
+	for (prio = 0; prio < WQ_NR_PRIO; prio++)
+		if (lane_has_work(&lanes[prio]))
+			return true;
+
+	return false;
+}
+
+/* Per-CPU worker may steal, so it looks at every CPU */
+static bool wq_has_work(struct workqueue *wq)
+{
+	struct wq_cpu *c;
+	unsigned int i;
+
+	if (wq->cpus == NULL)
+		return lanes_has_work(wq->lanes);
+
+	for (i = 0; i < wq->nr_cpus; i++) {
+		c = &wq->cpus[i];
+		if (lanes_has_work(c->lanes) || deque_has_work(&c->deque))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Managed pool doesn't let more workers run than there are CPUs. Extra
+ * ones, which come back from blocking calls, park instead.
+ */
+static bool wq_may_run(struct workqueue *wq)
+{
+	return !wq->managed ||
+		atomic_load(&wq->nr_running) <= wq->concurrency;
+}
+
+/*
+ * Sleep until producer bumps wake_seq or the next timer is due. Work and
+ * timers are checked again after nr_parked is raised, so either we see
+ * them or producer sees us. Per-CPU worker sleeps on its own wake_seq.
+ * Managed worker is not running while parked. Returns true if it has
+ * slept through WQ_IDLE_TIMEOUT.
+ */
+static bool wq_park(struct workqueue *wq)
+{
+	atomic_uint *wake_seq = this_cpu != NULL ? &this_cpu->wake_seq :
+		&wq->wake_seq;
+	unsigned int seq = atomic_load(wake_seq);
+	struct timespec ts, *timeout = NULL;
+	uint64_t next, now, start = 0;
+	bool idle = false;
+
+	if (this_cpu != NULL)
+		atomic_store(&this_cpu->parked, true);
+	if (wq->managed)
+		atomic_fetch_sub(&wq->nr_running, 1);
+	atomic_fetch_add(&wq->nr_parked, 1);
+
+	next = atomic_load(&wq->next_timer);
+	if (next != UINT64_MAX) {
+		now = now_ms();
+		if (next <= now)
+			goto out;
+	}
+
+	if (wq->managed) {
+		start = now_ms();
+		if (next > start + WQ_IDLE_TIMEOUT)
+			next = start + WQ_IDLE_TIMEOUT;
+		now = start;
+	}
+
+	if (next != UINT64_MAX) {
+		ts.tv_sec = (next - now) / 1000;
+		ts.tv_nsec = (next - now) % 1000 * 1000000;
+		timeout = &ts;
+	}
+
+	if (wq_has_work(wq) && (!wq->managed ||
+	    atomic_load(&wq->nr_running) < wq->concurrency))
+		goto out;
+
+	if (atomic_load(&wq->stopping))
+		goto out;
+
+	futex_wait(wake_seq, seq, timeout);
+
+	idle = wq->managed && now_ms() - start >= WQ_IDLE_TIMEOUT;
+
+out:
+	if (wq->managed)
+		atomic_fetch_add(&wq->nr_running, 1);
+	atomic_fetch_sub(&wq->nr_parked, 1);
+	if (this_cpu != NULL)
+		atomic_store(&this_cpu->parked, false);
+
+	return idle;
+}
+
+/*
+ * Poll the queue for a while before going to sleep. Returns true if the
+ * worker has been idle for long.
+ */
+static bool wq_idle(struct workqueue *wq)
+{
+	unsigned int spin = atomic_load_explicit(&wq->spin,
+		memory_order_relaxed);
+	unsigned int i;
+
+	for (i = 0; i < spin; i++) {
+		if ((wq_has_work(wq) && wq_may_run(wq)) ||
+		    atomic_load(&wq->stopping) || wq_timers_due(wq))
+			return false;
+
+		/* Give the CPU away in the second half, producer may need it */
+		if (i < spin / 2)
+			cpu_relax();
+		else
+			sched_yield();
+	}
+
+	return wq_park(wq);
+}
+
+/*
+ * Take the first item, called by the only consumer. Returns NULL if the
+ * queue is empty or its producer hasn't linked the item yet.
+ */
+static struct work *lane_pop(struct wq_lane *lane)
+{
+	struct work *head = lane->head;
+	struct work *next;
+
+	next = atomic_load_explicit(&head->next, memory_order_acquire);
+
+	if (head == &lane->stub) {
+		if (next == NULL)
+			return NULL;
+
+		lane->head = next;
+		head = next;
+		next = atomic_load_explicit(&head->next, memory_order_acquire);
+	}
+
+	if (next != NULL) {
+		lane->head = next;
+		return head;
+	}
+
+	if (head != atomic_load_explicit(&lane->tail, memory_order_acquire))
+		return NULL;
+
+	/* Head is the last item, put stub after it to detach it */
+	lane_push(lane, &lane->stub);
+
+	next = atomic_load_explicit(&head->next, memory_order_acquire);
+	if (next != NULL) {
+		lane->head = next;
+		return head;
+	}
+
+	return NULL;
+}
+
+/*
+ * Take from the highest lane which has something, unless a lower one has
+ * been starved for too long. Lowest starved lane goes first.
+ */
+static struct work *lanes_pop(struct wq_lane *lanes)
+{
+	struct wq_lane *lane;
+	struct work *work = NULL;
+	unsigned int prio, i;
+
+	for (prio = WQ_NR_PRIO - 1; prio > 0; prio--) {
+		lane = &lanes[prio];
+		if (lane->starved < WQ_STARVE_LIMIT)
+			continue;
+
+		work = lane_pop(lane);
+		if (work != NULL) {
+			lane->starved = 0;
+			return work;
+		}
+	}
+
+	for (prio = 0; prio < WQ_NR_PRIO; prio++) {
+		work = lane_pop(&lanes[prio]);
+		if (work != NULL)
+			break;
+	}
+
+	if (work == NULL)
+		return NULL;
+
+	lanes[prio].starved = 0;
+	for (i = prio + 1; i < WQ_NR_PRIO; i++) {
+		lane = &lanes[i];
+		if (lane_has_work(lane))
+			lane->starved++;
+		else
+			lane->starved = 0;
+	}
+
+	return work;
+}
+
+/* Rob other CPUs, starting from the next one */
+static struct work *cpu_steal(struct workqueue *wq, struct wq_cpu *c)
+{
+	struct wq_cpu *victim;
+	struct work *work;
+	unsigned int i;
+
+	for (i = 1; i < wq->nr_cpus; i++) {
+		victim = &wq->cpus[(c - wq->cpus + i) % wq->nr_cpus];
+
+		work = deque_steal(&victim->deque);
+		if (work != NULL)
+			return work;
+
+		/* Owner is at it, don't wait when there are other victims */
+		if (!spin_trylock(&victim->pop_lock))
+			continue;
+
+		work = lanes_pop(victim->lanes);
+		spin_unlock(&victim->pop_lock);
+
+		if (work != NULL)
+			return work;
+	}
+
+	return NULL;
+}
+
+/*
+ * Own lanes go first, so priorities hold. Items queued by the worker
+ * itself wait on the deque, which gets a turn at least every
+ * WQ_STARVE_LIMIT items. Other CPUs are robbed when there is nothing.
+ */
+static struct work *cpu_take(struct workqueue *wq, struct wq_cpu *c)
+{
+	struct work *work;
+
+	if (c->skipped >= WQ_STARVE_LIMIT) {
+		c->skipped = 0;
+		work = deque_pop(&c->deque);
+		if (work != NULL)
+			return work;
+	}
+
+	spin_lock(&c->pop_lock);
+	work = lanes_pop(c->lanes);
+	spin_unlock(&c->pop_lock);
+
+	if (work != NULL) {
+		if (deque_has_work(&c->deque))
+			c->skipped++;
+		return work;
+	}
+
+	work = deque_pop(&c->deque);
+	if (work != NULL)
+		return work;
+
+	return cpu_steal(wq, c);
+}
+
+static struct work *wq_take(struct workqueue *wq)
+{
+	struct work *work;
+
+	if (this_cpu != NULL)
+		return cpu_take(wq, this_cpu);
+
+	if (wq->shared)
+		spin_lock(&wq->pop_lock);
+
+	work = lanes_pop(wq->lanes);
+
+	if (wq->shared)
+		spin_unlock(&wq->pop_lock);
+
+	return work;
+}
+
+/*
+ * Run everything there is, then idle. An item which is not linked yet
+ * keeps wq_has_work() true, so the worker comes back for it. Timers are
+ * serviced before every item, anything they queue is run in the same go.
+ */
+static void worker_loop(struct workqueue *wq)
+{
+	struct work *work;
+	unsigned int color;
+
+	while (1) {
+		wq_run_timers(wq);
+
+		while (wq_may_run(wq) && (work = wq_take(wq)) != NULL) {
+			/* Work may be freed or queued again by func */
+			color = work->color;
+			work->func(work);
+			wq_done(wq, color, 1);
+			wq_run_timers(wq);
+		}
+
+		if (atomic_load(&wq->stopping))
+			break;
+
+		if (wq_idle(wq) && wq_retire(wq))
+			break;
+
+		/* Raw futex wait is not a cancellation point */
+		pthread_testcancel();
+	}
+}
+
 void *worker_thread(void *cookie)
 {
-	struct task *cur_work;
-	struct workqueue *wq = cookie;
+	worker_loop(cookie);
+
+	return NULL;
+}
+
+enum {
+	WQ_SLOT_FREE,
+	WQ_SLOT_LIVE,
+	WQ_SLOT_DEAD,
+};
+
+/*
+ * Start a worker of managed pool in the first slot which has no live
+ * thread, joining the one which has exited there. Called with
+ * manage_lock held, new worker counts as running from the start.
+ */
+static int wq_spawn(struct workqueue *wq)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < wq->max_threads; i++)
+		if (wq->slots[i] != WQ_SLOT_LIVE)
+			break;
+
+	if (i == wq->max_threads)
+		return -1;
+
+	if (wq->slots[i] == WQ_SLOT_DEAD) {
+		pthread_join(wq->threads[i], NULL);
+		wq->slots[i] = WQ_SLOT_FREE;
+	}
+
+	atomic_fetch_add(&wq->nr_running, 1);
+
+	ret = pthread_create(&wq->threads[i], NULL, worker_thread, wq);
+	if (ret) {
+		atomic_fetch_sub(&wq->nr_running, 1);
+		return ret;
+	}
+
+	wq->slots[i] = WQ_SLOT_LIVE;
+	atomic_fetch_add(&wq->nr_workers, 1);
+	if (wq->nr_threads < i + 1)
+		wq->nr_threads = i + 1;
+
+	return 0;
+}
+
+/*
+ * Work or a timer is waiting and nobody is parked: start one more worker,
+ * if there are CPUs it may run on and room for it. Cancellation is held
+ * off, so a worker cancelled here doesn't leave manage_lock locked.
+ */
+static void wq_need_worker(struct workqueue *wq)
+{
+	int state;
+
+	if (atomic_load(&wq->nr_running) >= wq->concurrency ||
+	    atomic_load(&wq->nr_workers) >= wq->max_threads)
+		return;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	pthread_mutex_lock(&wq->manage_lock);
+
+	if (!atomic_load(&wq->stopping) &&
+	    atomic_load(&wq->nr_running) < wq->concurrency)
+		wq_spawn(wq);
+
+	pthread_mutex_unlock(&wq->manage_lock);
+	pthread_setcancelstate(state, NULL);
+}
+
+/*
+ * Let idle worker of managed pool exit, unless the pool is at minimum.
+ * It stops counting as running and as a worker before looking for work
+ * again, so a producer which finds nobody parked either sees room to
+ * start a worker or has its work seen here. Pairs with the fence in
+ * wq_wake(). The last worker stays while a timer is armed, the same way
+ * against delayed_queue().
+ */
+static bool wq_retire(struct workqueue *wq)
+{
+	bool ret = false;
+	unsigned int i;
+
+	if (!wq->managed)
+		return false;
+
+	pthread_mutex_lock(&wq->manage_lock);
+
+	if (atomic_load(&wq->stopping) ||
+	    atomic_load(&wq->nr_workers) <= wq->min_threads)
+		goto out;
+
+	for (i = 0; i < wq->nr_threads; i++)
+		if (wq->slots[i] == WQ_SLOT_LIVE &&
+		    pthread_equal(wq->threads[i], pthread_self()))
+			break;
+
+	if (i == wq->nr_threads)
+		goto out;
+
+	atomic_fetch_sub(&wq->nr_running, 1);
+	if (atomic_fetch_sub(&wq->nr_workers, 1) == 1 &&
+	    atomic_load(&wq->next_timer) != UINT64_MAX)
+		goto undo;
+
+	if (wq_has_work(wq))
+		goto undo;
+
+	wq->slots[i] = WQ_SLOT_DEAD;
+	ret = true;
+	goto out;
+
+undo:
+	atomic_fetch_add(&wq->nr_workers, 1);
+	atomic_fetch_add(&wq->nr_running, 1);
+out:
+	pthread_mutex_unlock(&wq->manage_lock);
+
+	return ret;
+}
+
+/*
+ * Stop workers from being started or retired, so that the threads to
+ * join are known.
+ */
+static void wq_stop(struct workqueue *wq)
+{
+	pthread_mutex_lock(&wq->manage_lock);
+	atomic_store(&wq->stopping, true);
+	pthread_mutex_unlock(&wq->manage_lock);
+}
+
+/* Slot of managed pool may have no thread */
+static bool wq_joinable(struct workqueue *wq, unsigned int i)
+{
+	return wq->slots == NULL || wq->slots[i] != WQ_SLOT_FREE;
+}
+
+/* Worker of a per-CPU queue, pinned to its CPU by creator */
+static void *cpu_worker_thread(void *cookie)
+{
+	struct wq_cpu *c = cookie;
+
+	this_cpu = c;
+	worker_loop(c->wq);
+
+	return NULL;
+}
+
+int wq_init(struct workqueue *wq)
+{
+	return wq_init_pool(wq, 1, true);
+}
+
+/* Everything but workers, which are started by the caller */
+static int wq_setup(struct workqueue *wq, unsigned int nthreads)
+{
+	int ret;
+
+	lanes_init(wq->lanes);
+	atomic_flag_clear(&wq->pop_lock);
+	wq->shared = false;
+	atomic_init(&wq->free, NULL);
+	wq->id = atomic_fetch_add(&wq_next_id, 1) + 1;
+	atomic_init(&wq->color, 0);
+	atomic_init(&wq->in_flight[0], 0);
+	atomic_init(&wq->in_flight[1], 0);
+	atomic_init(&wq->flushers, 0);
+	atomic_init(&wq->stopping, false);
+	atomic_init(&wq->spin, WQ_DEFAULT_SPIN);
+	atomic_init(&wq->nr_parked, 0);
+	atomic_init(&wq->wake_seq, 0);
+	memset(wq->wheel, 0, sizeof(wq->wheel));
+	memset(wq->pending, 0, sizeof(wq->pending));
+	wq->clk = now_ms();
+	atomic_init(&wq->next_timer, UINT64_MAX);
+	wq->nr_threads = 0;
+	wq->max_threads = nthreads;
+	wq->managed = false;
+	wq->concurrency = 0;
+	wq->min_threads = 0;
+	atomic_init(&wq->nr_running, 0);
+	atomic_init(&wq->nr_workers, 0);
+	wq->slots = NULL;
+	wq->cpus = NULL;
+	wq->nr_cpus = 0;
+	wq->cpu_map = NULL;
+
+	wq->threads = malloc(nthreads * sizeof(*wq->threads));
+	if (wq->threads == NULL)
+		return -1;
+
+	ret = pthread_mutex_init(&wq->flush_lock, NULL);
+	if (ret)
+		goto err_flush_lock;
+
+	ret = pthread_mutex_init(&wq->done_lock, NULL);
+	if (ret)
+		goto err_done_lock;
+
+	ret = pthread_cond_init(&wq->done, NULL);
+	if (ret)
+		goto err_done;
+
+	ret = pthread_mutex_init(&wq->timer_lock, NULL);
+	if (ret)
+		goto err_timer_lock;
+
+	ret = pthread_cond_init(&wq->timer_idle, NULL);
+	if (ret)
+		goto err_timer_idle;
+
+	ret = pthread_mutex_init(&wq->manage_lock, NULL);
+	if (ret)
+		goto err_manage_lock;
+
+	return 0;
+
+err_manage_lock:
+	pthread_cond_destroy(&wq->timer_idle);
+err_timer_idle:
+	pthread_mutex_destroy(&wq->timer_lock);
+err_timer_lock:
+	pthread_cond_destroy(&wq->done);
+err_done:
+	pthread_mutex_destroy(&wq->done_lock);
+err_done_lock:
+	pthread_mutex_destroy(&wq->flush_lock);
+err_flush_lock:
+	free(wq->threads);
+	return ret;
+}
+
+/* Undo wq_setup() once workers are gone */
+static void wq_teardown(struct workqueue *wq)
+{
+	pthread_mutex_destroy(&wq->manage_lock);
+	pthread_cond_destroy(&wq->timer_idle);
+	pthread_mutex_destroy(&wq->timer_lock);
+	pthread_cond_destroy(&wq->done);
+	pthread_mutex_destroy(&wq->done_lock);
+	pthread_mutex_destroy(&wq->flush_lock);
+	free(wq->slots);
+	free(wq->cpu_map);
+	free(wq->cpus);
+	free(wq->threads);
+}
+
+/*
+ * Start nthreads workers over the same queue. Tasks of unordered queue may
+ * run concurrently and finish in any order. Ordered queue runs them one at
+ * a time in the order they were added, so it always has a single worker.
+ */
+int wq_init_pool(struct workqueue *wq, unsigned int nthreads, bool ordered)
+{
+	unsigned int i;
+	int ret;
+
+	if (ordered)
+		nthreads = 1;
+
+	if (nthreads == 0)
+		return -1;
+
+	ret = wq_setup(wq, nthreads);
+	if (ret)
+		return ret;
+
+	wq->shared = nthreads > 1;
+
+	for (i = 0; i < nthreads; i++) {
+		ret = pthread_create(&wq->threads[i], NULL, worker_thread, wq);
+		if (ret)
+			goto err_thread;
+		wq->nr_threads++;
+	}
+
+	return 0;
+
+err_thread:
+	wq_cancel(wq);
+	wq_teardown(wq);
+	return ret;
+}
+
+static void cpu_init(struct workqueue *wq, struct wq_cpu *c, int cpu)
+{
+	lanes_init(c->lanes);
+	atomic_flag_clear(&c->pop_lock);
+	atomic_init(&c->deque.top, 0);
+	atomic_init(&c->deque.bottom, 0);
+	c->skipped = 0;
+	atomic_init(&c->wake_seq, 0);
+	atomic_init(&c->parked, false);
+	c->cpu = cpu;
+	c->wq = wq;
+}
+
+/*
+ * Start a worker pinned to every CPU the caller may run on, like the
+ * kernel's per-CPU workqueues. Items are queued on the CPU they are
+ * submitted from and usually run there, idle workers steal from busy
+ * ones. As in unordered pool, items may run concurrently in any order.
+ */
+int wq_init_percpu(struct workqueue *wq)
+{
+	pthread_attr_t attr;
+	cpu_set_t set, one;
+	struct wq_cpu *c;
+	unsigned int nr, i;
+	int cpu, ret;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return -1;
+
+	nr = CPU_COUNT(&set);
+
+	ret = wq_setup(wq, nr);
+	if (ret)
+		return ret;
+
+	wq->cpu_map = malloc(CPU_SETSIZE * sizeof(*wq->cpu_map));
+	wq->cpus = calloc(nr, sizeof(*wq->cpus));
+	if (wq->cpu_map == NULL || wq->cpus == NULL) {
+		ret = -1;
+		goto err;
+	}
+
+	for (cpu = 0, i = 0; cpu < CPU_SETSIZE; cpu++) {
+		wq->cpu_map[cpu] = -1;
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+
+		wq->cpu_map[cpu] = i;
+		cpu_init(wq, &wq->cpus[i++], cpu);
+	}
+	wq->nr_cpus = nr;
+
+	ret = pthread_attr_init(&attr);
+	if (ret)
+		goto err;
+
+	for (i = 0; i < nr; i++) {
+		c = &wq->cpus[i];
+
+		CPU_ZERO(&one);
+		CPU_SET(c->cpu, &one);
+		ret = pthread_attr_setaffinity_np(&attr, sizeof(one), &one);
+		if (ret)
+			goto err_thread;
+
+		ret = pthread_create(&wq->threads[i], &attr,
+			cpu_worker_thread, c);
+		if (ret)
+			goto err_thread;
+		wq->nr_threads++;
+	}
+
+	pthread_attr_destroy(&attr);
+
+	return 0;
+
+err_thread:
+	pthread_attr_destroy(&attr);
+	wq_cancel(wq);
+err:
+	wq_teardown(wq);
+	return ret;
+}
+
+/*
+ * Start a pool which keeps about as many workers running as there are
+ * CPUs, with min to max threads, like the kernel's cmwq. Handlers mark
+ * blocking calls with wq_block_begin() and wq_block_end(), and another
+ * worker takes over the queue meanwhile. Workers idle for WQ_IDLE_TIMEOUT
+ * ms exit, down to min. Items may run concurrently in any order.
+ */
+int wq_init_managed(struct workqueue *wq, unsigned int min, unsigned int max)
+{
+	cpu_set_t set;
+	unsigned int i;
+	int ret;
+
+	if (max == 0 || min > max)
+		return -1;
+
+	ret = wq_setup(wq, max);
+	if (ret)
+		return ret;
+
+	wq->shared = true;
+	wq->managed = true;
+	wq->min_threads = min;
+
+	wq->concurrency = 1;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		wq->concurrency = CPU_COUNT(&set);
+	if (wq->concurrency > max)
+		wq->concurrency = max;
+
+	wq->slots = calloc(max, sizeof(*wq->slots));
+	if (wq->slots == NULL) {
+		ret = -1;
+		goto err;
+	}
+
+	pthread_mutex_lock(&wq->manage_lock);
+	for (i = 0; i < min; i++) {
+		ret = wq_spawn(wq);
+		if (ret)
+			break;
+	}
+	pthread_mutex_unlock(&wq->manage_lock);
+
+	if (ret)
+		goto err_thread;
+
+	return 0;
+
+err_thread:
+	wq_cancel(wq);
+err:
+	wq_teardown(wq);
+	return ret;
+}
+
+static struct wq_cpu *wq_cpu_of(struct workqueue *wq, int cpu)
+{
+	if (cpu < 0 || cpu >= CPU_SETSIZE || wq->cpu_map[cpu] < 0)
+		return NULL;
 
-	while (1) {
-		sem_wait(&wq->sem);
+	return &wq->cpus[wq->cpu_map[cpu]];
+}
+
+/*
+ * CPU to queue on from here, NULL for the shared lanes. Our affinity may
+ * have changed since the queue was created, then any CPU will do.
+ */
+static struct wq_cpu *wq_local(struct workqueue *wq)
+{
+	struct wq_cpu *c;
+	int cpu;
+
+	if (wq->cpus == NULL)
+		return NULL;
+
+	if (this_cpu != NULL && this_cpu->wq == wq)
+		return this_cpu;
+
+	cpu = sched_getcpu();
+	c = wq_cpu_of(wq, cpu);
+	if (c == NULL)
+		c = &wq->cpus[(unsigned int)cpu % wq->nr_cpus];
+
+	return c;
+}
+
+static struct wq_lane *wq_lanes(struct workqueue *wq, struct wq_cpu *c)
+{
+	return c != NULL ? c->lanes : wq->lanes;
+}
+
+/*
+ * Worker keeps normal items it queues itself on its deque, where they
+ * stay cache-warm unless somebody idle steals them.
+ */
+static int wq_queue_on(struct workqueue *wq, struct wq_cpu *c,
+	struct work *work)
+{
+	work->color = wq_begin(wq, 1);
+
+	if (c == NULL || c != this_cpu || work->prio != WQ_PRIO_NORMAL ||
+	    !deque_push(&c->deque, work))
+		lane_push(&wq_lanes(wq, c)[work->prio], work);
+
+	wq_wake(wq, c, 1);
 
-		cur_work = wq->task;
-		cur_work->handler(cur_work->cookie);
+	return 0;
+}
+
+int wq_queue_work(struct workqueue *wq, struct work *work)
+{
+	return wq_queue_on(wq, wq_local(wq), work);
+}
+
+/* Queue on the given CPU, which per-CPU queue must have a worker for */
+int wq_queue_work_on(struct workqueue *wq, int cpu, struct work *work)
+{
+	struct wq_cpu *c = NULL;
 
-		wq->task = cur_work->next;
-		free(cur_work);
+	if (wq->cpus != NULL) {
+		c = wq_cpu_of(wq, cpu);
+		if (c == NULL)
+			return -1;
 	}
 
-	return NULL;
+	return wq_queue_on(wq, c, work);
 }
 
-int wq_init(struct workqueue *wq)
+/*
+ * Submit nr items with one wakeup per worker. Every run of items of the
+ * same priority is published at once.
+ */
+int wq_queue_batch(struct workqueue *wq, struct work **works, unsigned int nr)
 {
-	int ret;
+	struct wq_cpu *c = wq_local(wq);
+	struct wq_lane *lanes = wq_lanes(wq, c);
+	unsigned int color;
+	unsigned int first = 0;
+	unsigned int i;
 
-	wq->new = &wq->task;
+	if (nr == 0)
+		return 0;
 
-	ret = sem_init(&wq->sem, 0, 0);
-	if (ret)
-		return ret;
+	color = wq_begin(wq, nr);
 
-	ret = pthread_create(&wq->thread, NULL, worker_thread, wq);
-	if (ret) {
-		sem_destroy(&wq->sem);
-		return ret;
+	for (i = 0; i < nr; i++) {
+		works[i]->color = color;
+
+		if (i + 1 < nr && works[i + 1]->prio == works[i]->prio) {
+			atomic_store_explicit(&works[i]->next, works[i + 1],
+				memory_order_relaxed);
+			continue;
+		}
+
+		lane_push_chain(&lanes[works[i]->prio], works[first], works[i]);
+		first = i + 1;
 	}
 
+	wq_wake(wq, c, nr);
+
 	return 0;
 }
 
+static void task_list_free(struct task *task)
+{
+	struct task *next;
+
+	for (; task != NULL; task = next) {
+		next = task->free_next;
+		free(task);
+	}
+}
+
+/* Runs when a thread which ever filled its cache exits */
+static void task_cache_exit(void *cookie)
+{
+	struct task_cache *cache = cookie;
+
+	task_list_free(cache->list);
+	cache->list = NULL;
+}
+
+static void task_cache_key_init(void)
+{
+	pthread_key_create(&task_cache_key, task_cache_exit);
+}
+
+static struct task *task_get(struct workqueue *wq)
+{
+	struct task_cache *cache = &task_cache;
+	struct task *task;
+
+	if (cache->id != wq->id) {
+		task_list_free(cache->list);
+		cache->list = NULL;
+		cache->id = wq->id;
+	}
+
+	if (cache->list == NULL) {
+		cache->list = atomic_exchange_explicit(&wq->free, NULL,
+			memory_order_acquire);
+		if (cache->list == NULL)
+			return NULL;
+
+		if (!task_cache_registered) {
+			pthread_once(&task_cache_once, task_cache_key_init);
+			pthread_setspecific(task_cache_key, cache);
+			task_cache_registered = true;
+		}
+	}
+
+	task = cache->list;
+	cache->list = task->free_next;
+
+	return task;
+}
+
+static void task_put(struct workqueue *wq, struct task *task)
+{
+	struct task *head = atomic_load_explicit(&wq->free,
+		memory_order_relaxed);
+
+	do {
+		task->free_next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&wq->free, &head,
+			task, memory_order_release, memory_order_relaxed));
+}
+
+static void task_run(struct work *work)
+{
+	struct task *task = container_of(work, struct task, work);
+	void (*handler)(void *) = task->handler;
+	void *cookie = task->cookie;
+
+	task_put(task->wq, task);
+	handler(cookie);
+}
+
+static struct task *task_alloc(struct workqueue *wq,
+	void (*handler)(void *), void *cookie)
+{
+	struct task *task;
+
+	task = task_get(wq);
+	if (task == NULL) {
+		task = malloc(sizeof *task);
+		if (task == NULL)
+			return NULL;
+	}
+
+	wq_init_work(&task->work, task_run);
+	task->handler = handler;
+	task->cookie = cookie;
+	task->wq = wq;
+
+	return task;
+}
+
 int wq_add(struct workqueue *wq, void (*handler)(void *), void *cookie)
+{
+	return wq_add_prio(wq, WQ_PRIO_NORMAL, handler, cookie);
+}
+
+int wq_add_prio(struct workqueue *wq, unsigned int prio,
+	void (*handler)(void *), void *cookie)
 {
 	struct task *task;
 
-	task = malloc(sizeof *task);
+	task = task_alloc(wq, handler, cookie);
 	if (task == NULL)
 		return -1;
 
-	task->handler = handler;
-	task->cookie = cookie;
-	task->next = NULL;
+	wq_set_prio(&task->work, prio);
+
+	return wq_queue_work(wq, &task->work);
+}
+
+int wq_add_on(struct workqueue *wq, int cpu, void (*handler)(void *),
+	void *cookie)
+{
+	struct task *task;
+
+	if (wq->cpus != NULL && wq_cpu_of(wq, cpu) == NULL)
+		return -1;
+
+	task = task_alloc(wq, handler, cookie);
+	if (task == NULL)
+		return -1;
+
+	return wq_queue_work_on(wq, cpu, &task->work);
+}
+
+/*
+ * Run handler once for every cookie at normal priority, either all are
+ * added or none.
+ */
+int wq_add_batch(struct workqueue *wq, void (*handler)(void *),
+	void **cookies, unsigned int nr)
+{
+	struct task *first = NULL;
+	struct task *last = NULL;
+	struct task *task;
+	struct wq_cpu *c;
+	unsigned int color;
+	unsigned int i;
+
+	if (nr == 0)
+		return 0;
+
+	for (i = 0; i < nr; i++) {
+		task = task_alloc(wq, handler, cookies[i]);
+		if (task == NULL)
+			goto err;
+
+		if (last != NULL)
+			atomic_store_explicit(&last->work.next, &task->work,
+				memory_order_relaxed);
+		else
+			first = task;
+		last = task;
+	}
+
+	color = wq_begin(wq, nr);
+	for (task = first; task != last; task = container_of(
+			atomic_load_explicit(&task->work.next,
+				memory_order_relaxed), struct task, work))
+		task->work.color = color;
+	last->work.color = color;
+
+	c = wq_local(wq);
+	lane_push_chain(&wq_lanes(wq, c)[WQ_PRIO_NORMAL], &first->work,
+		&last->work);
+	wq_wake(wq, c, nr);
+
+	return 0;
+
+err:
+	while (first != NULL) {
+		task = first;
+		first = first == last ? NULL : container_of(
+			atomic_load_explicit(&first->work.next,
+				memory_order_relaxed), struct task, work);
+		task_put(wq, task);
+	}
+
+	return -1;
+}
+
+enum {
+	DW_IDLE,
+	DW_ARMED,
+	DW_QUEUED,
+};
+
+static void wheel_link(struct workqueue *wq, struct delayed_work *dw)
+{
+	struct delayed_work **head = &wq->wheel[dw->level][dw->slot];
+
+	dw->next = *head;
+	if (dw->next != NULL)
+		dw->next->pprev = &dw->next;
+	dw->pprev = head;
+	*head = dw;
+
+	wq->pending[dw->level] |= (uint64_t)1 << dw->slot;
+}
+
+static void wheel_unlink(struct workqueue *wq, struct delayed_work *dw)
+{
+	*dw->pprev = dw->next;
+	if (dw->next != NULL)
+		dw->next->pprev = dw->pprev;
+
+	if (wq->wheel[dw->level][dw->slot] == NULL)
+		wq->pending[dw->level] &= ~((uint64_t)1 << dw->slot);
+}
+
+/*
+ * Put timer on the lowest level which reaches it, at most a full turn
+ * ahead of clk. Timer beyond the last level is put as far as it goes and
+ * gets there again when its slot comes.
+ */
+static void wheel_add(struct workqueue *wq, struct delayed_work *dw)
+{
+	uint64_t t = dw->expires > wq->clk ? dw->expires : wq->clk + 1;
+	unsigned int level;
+	unsigned int shift;
+	uint64_t idx;
+
+	for (level = 0; level < WQ_WHEEL_LEVELS - 1; level++) {
+		shift = WQ_WHEEL_BITS * level;
+		if ((t >> shift) - (wq->clk >> shift) <= WQ_WHEEL_SIZE)
+			break;
+	}
 
-	*(wq->new) = task;
-	wq->new = &task->next;
+	shift = WQ_WHEEL_BITS * level;
+	idx = t >> shift;
+	if (idx - (wq->clk >> shift) > WQ_WHEEL_SIZE)
+		idx = (wq->clk >> shift) + WQ_WHEEL_SIZE;
 
-	sem_post(&wq->sem);
+	dw->level = level;
+	dw->slot = idx & (WQ_WHEEL_SIZE - 1);
+	wheel_link(wq, dw);
+}
+
+/*
+ * Time of the next event, either expiry on level 0 or cascade from upper
+ * one. Slot right after the current is the nearest, current one is a full
+ * turn away.
+ */
+static uint64_t wheel_next(struct workqueue *wq)
+{
+	uint64_t next = UINT64_MAX;
+	uint64_t pending, idx, event;
+	unsigned int level, shift, rot;
+
+	for (level = 0; level < WQ_WHEEL_LEVELS; level++) {
+		pending = wq->pending[level];
+		if (pending == 0)
+			continue;
+
+		shift = WQ_WHEEL_BITS * level;
+		idx = wq->clk >> shift;
+		rot = (idx + 1) & (WQ_WHEEL_SIZE - 1);
+		pending = pending >> rot | pending << ((WQ_WHEEL_SIZE - rot) &
+			(WQ_WHEEL_SIZE - 1));
+
+		event = (idx + __builtin_ctzll(pending) + 1) << shift;
+		if (event < next)
+			next = event;
+	}
+
+	return next;
+}
+
+static struct delayed_work *wheel_detach(struct workqueue *wq,
+	unsigned int level, unsigned int slot)
+{
+	struct delayed_work *list = wq->wheel[level][slot];
+
+	wq->wheel[level][slot] = NULL;
+	wq->pending[level] &= ~((uint64_t)1 << slot);
+
+	return list;
+}
+
+/*
+ * Move clk to now, firing everything due on the way. Upper levels are
+ * cascaded while clk is one tick short of the event, so that timers
+ * expiring right at it still land on level 0 and fire in the same step.
+ */
+static void wheel_advance(struct workqueue *wq, uint64_t now)
+{
+	struct delayed_work *dw, *next_dw;
+	unsigned int level, shift;
+	uint64_t next;
+
+	while ((next = wheel_next(wq)) <= now) {
+		wq->clk = next - 1;
+
+		for (level = WQ_WHEEL_LEVELS - 1; level > 0; level--) {
+			shift = WQ_WHEEL_BITS * level;
+			if (next & (((uint64_t)1 << shift) - 1))
+				continue;
+
+			dw = wheel_detach(wq, level,
+				(next >> shift) & (WQ_WHEEL_SIZE - 1));
+			for (; dw != NULL; dw = next_dw) {
+				next_dw = dw->next;
+				wheel_add(wq, dw);
+			}
+		}
+
+		wq->clk = next;
+
+		dw = wheel_detach(wq, 0, next & (WQ_WHEEL_SIZE - 1));
+		for (; dw != NULL; dw = next_dw) {
+			next_dw = dw->next;
+			dw->state = DW_QUEUED;
+			wq_queue_work(wq, &dw->work);
+		}
+	}
+
+	if (now > wq->clk)
+		wq->clk = now;
+}
+
+/*
+ * Called with timer_lock held. Wakes a parked worker if the timer is
+ * earlier than anything armed, so that it sleeps for less. Nothing is
+ * queued yet, so no worker is started for it.
+ */
+static void delayed_arm(struct workqueue *wq, struct delayed_work *dw,
+	uint64_t now)
+{
+	uint64_t next;
+
+	wheel_advance(wq, now);
+
+	dw->state = DW_ARMED;
+	wheel_add(wq, dw);
+
+	next = wheel_next(wq);
+	if (next < atomic_exchange(&wq->next_timer, next))
+		wq_wake_parked(wq, NULL, 1);
+}
+
+static void wq_run_timers(struct workqueue *wq)
+{
+	if (!wq_timers_due(wq) || atomic_load(&wq->stopping))
+		return;
+
+	/* Somebody else is on it */
+	if (pthread_mutex_trylock(&wq->timer_lock))
+		return;
+
+	wheel_advance(wq, now_ms());
+	atomic_store(&wq->next_timer, wheel_next(wq));
+
+	pthread_mutex_unlock(&wq->timer_lock);
+}
+
+/*
+ * One-shot work is idle before its handler is called, so the handler may
+ * queue it again. Periodic one is armed again after it, unless cancelled,
+ * skipping periods it has missed.
+ */
+static void delayed_run(struct work *work)
+{
+	struct delayed_work *dw = container_of(work, struct delayed_work, work);
+	struct workqueue *wq = dw->wq;
+	void (*handler)(void *) = dw->handler;
+	void *cookie = dw->cookie;
+	bool autofree = dw->autofree;
+	uint64_t now;
+
+	if (dw->period == 0) {
+		pthread_mutex_lock(&wq->timer_lock);
+		dw->state = DW_IDLE;
+		pthread_cond_broadcast(&wq->timer_idle);
+		pthread_mutex_unlock(&wq->timer_lock);
+
+		if (autofree)
+			free(dw);
+
+		handler(cookie);
+		return;
+	}
+
+	handler(cookie);
+
+	pthread_mutex_lock(&wq->timer_lock);
+
+	if (dw->cancelled) {
+		dw->state = DW_IDLE;
+		pthread_cond_broadcast(&wq->timer_idle);
+	} else {
+		now = now_ms();
+		dw->expires += dw->period;
+		if (dw->expires < now)
+			dw->expires = now;
+		delayed_arm(wq, dw, now);
+	}
+
+	pthread_mutex_unlock(&wq->timer_lock);
+}
+
+static int delayed_queue(struct workqueue *wq, struct delayed_work *dw,
+	unsigned long delay, unsigned long period)
+{
+	uint64_t now;
+
+	pthread_mutex_lock(&wq->timer_lock);
+
+	if (dw->state != DW_IDLE) {
+		pthread_mutex_unlock(&wq->timer_lock);
+		return -1;
+	}
+
+	/* Priority set by wq_set_prio() is kept */
+	dw->work.func = delayed_run;
+	dw->wq = wq;
+	dw->period = period;
+	dw->cancelled = false;
+
+	if (delay == 0) {
+		dw->state = DW_QUEUED;
+		wq_queue_work(wq, &dw->work);
+	} else {
+		now = now_ms();
+		dw->expires = now + delay;
+		delayed_arm(wq, dw, now);
+	}
+
+	pthread_mutex_unlock(&wq->timer_lock);
+
+	/*
+	 * Managed pool which has shrunk to no workers needs one for the
+	 * timer. Exchange of next_timer in delayed_arm() pairs with the
+	 * decrement of nr_workers in wq_retire().
+	 */
+	if (wq->managed && delay != 0 && atomic_load(&wq->nr_workers) == 0)
+		wq_need_worker(wq);
 
 	return 0;
 }
 
+/* Fails if the work is still armed or queued */
+int wq_queue_delayed(struct workqueue *wq, struct delayed_work *dw,
+	unsigned long delay)
+{
+	return delayed_queue(wq, dw, delay, 0);
+}
+
+/* Run work every period ms, the first time a period from now */
+int wq_queue_periodic(struct workqueue *wq, struct delayed_work *dw,
+	unsigned long period)
+{
+	if (period == 0)
+		return -1;
+
+	return delayed_queue(wq, dw, period, period);
+}
+
+/*
+ * Disarm the timer, returns true if it hasn't fired yet. Work which is
+ * already queued or running isn't waited for, though periodic one won't
+ * be armed again. Until it is idle, it can't be queued again or freed.
+ */
+bool wq_cancel_delayed(struct workqueue *wq, struct delayed_work *dw)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&wq->timer_lock);
+
+	if (dw->state == DW_ARMED) {
+		wheel_unlink(wq, dw);
+		dw->state = DW_IDLE;
+		ret = true;
+	} else if (dw->state == DW_QUEUED) {
+		dw->cancelled = true;
+	}
+
+	pthread_mutex_unlock(&wq->timer_lock);
+
+	return ret;
+}
+
+/*
+ * Like wq_cancel_delayed(), but also waits until the work is idle, so it
+ * may be freed or queued again. Queued one-shot work still runs, and its
+ * handler may be running on return, since it is idle before the call.
+ * Must not be called from handler of the same work.
+ */
+bool wq_cancel_delayed_sync(struct workqueue *wq, struct delayed_work *dw)
+{
+	bool ret;
+
+	ret = wq_cancel_delayed(wq, dw);
+
+	pthread_mutex_lock(&wq->timer_lock);
+	while (dw->state != DW_IDLE)
+		pthread_cond_wait(&wq->timer_idle, &wq->timer_lock);
+	pthread_mutex_unlock(&wq->timer_lock);
+
+	return ret;
+}
+
+int wq_add_delayed(struct workqueue *wq, void (*handler)(void *),
+	void *cookie, unsigned long delay)
+{
+	struct delayed_work *dw;
+
+	dw = malloc(sizeof *dw);
+	if (dw == NULL)
+		return -1;
+
+	wq_init_delayed(dw, handler, cookie);
+	dw->autofree = true;
+
+	return wq_queue_delayed(wq, dw, delay);
+}
+
+/* Drop timers left when workers are gone */
+static void wheel_clear(struct workqueue *wq)
+{
+	struct delayed_work *dw, *next_dw;
+	unsigned int level, slot;
+
+	for (level = 0; level < WQ_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < WQ_WHEEL_SIZE; slot++) {
+			dw = wheel_detach(wq, level, slot);
+			for (; dw != NULL; dw = next_dw) {
+				next_dw = dw->next;
+				dw->state = DW_IDLE;
+				if (dw->autofree)
+					free(dw);
+			}
+		}
+	}
+
+	atomic_store(&wq->next_timer, UINT64_MAX);
+}
+
+/*
+ * Wait until everything submitted before the call has run. Must not be
+ * called from a work item of the same queue.
+ */
+void wq_flush(struct workqueue *wq)
+{
+	unsigned int old;
+
+	pthread_mutex_lock(&wq->flush_lock);
+	atomic_fetch_add(&wq->flushers, 1);
+
+	old = atomic_load(&wq->color);
+	atomic_store(&wq->color, !old);
+
+	pthread_mutex_lock(&wq->done_lock);
+	while (atomic_load(&wq->in_flight[old]) != 0)
+		pthread_cond_wait(&wq->done, &wq->done_lock);
+	pthread_mutex_unlock(&wq->done_lock);
+
+	atomic_fetch_sub(&wq->flushers, 1);
+	pthread_mutex_unlock(&wq->flush_lock);
+}
+
+/*
+ * Run everything already submitted, then stop workers and free the queue.
+ * Nothing may be submitted once it is called. Timers which haven't fired
+ * yet are dropped.
+ */
+void wq_destroy(struct workqueue *wq)
+{
+	unsigned int i;
+
+	wq_flush(wq);
+
+	wq_stop(wq);
+	wq_wake_all(wq);
+
+	for (i = 0; i < wq->nr_threads; i++)
+		if (wq_joinable(wq, i))
+			pthread_join(wq->threads[i], NULL);
+	wq->nr_threads = 0;
+
+	/*
+	 * Caches of other threads are freed once they exit or move to
+	 * another queue.
+	 */
+	if (task_cache.id == wq->id) {
+		task_list_free(task_cache.list);
+		task_cache.list = NULL;
+	}
+	task_list_free(atomic_exchange(&wq->free, NULL));
+
+	wheel_clear(wq);
+	wq_teardown(wq);
+}
+
+/*
+ * Called by a handler of managed pool around a call which may block. The
+ * worker stops counting as running meanwhile, so that a parked worker is
+ * woken up or a new one is started if work is waiting. No-op for other
+ * queues.
+ */
+void wq_block_begin(struct workqueue *wq)
+{
+	if (!wq->managed)
+		return;
+
+	atomic_fetch_sub(&wq->nr_running, 1);
+
+	if (wq_has_work(wq))
+		wq_wake(wq, NULL, 1);
+}
+
+/* Extra workers park once they are done with what they run */
+void wq_block_end(struct workqueue *wq)
+{
+	if (!wq->managed)
+		return;
+
+	atomic_fetch_add(&wq->nr_running, 1);
+}
+
+/*
+ * Number of times idle worker polls the queue before parking. More spin
+ * means less wakeup latency for bursts and more CPU burnt when idle, 0
+ * parks right away.
+ */
+void wq_set_spin(struct workqueue *wq, unsigned int spin)
+{
+	atomic_store_explicit(&wq->spin, spin, memory_order_relaxed);
+}
+
 int wq_cancel(struct workqueue *wq)
 {
-	return pthread_cancel(wq->thread);
+	unsigned int i;
+	int ret = 0;
+
+	/* Keeps workers from parking again once they are woken up below */
+	wq_stop(wq);
+
+	for (i = 0; i < wq->nr_threads; i++)
+		if (wq_joinable(wq, i) && pthread_cancel(wq->threads[i]))
+			ret = -1;
+
+	/* Get parked workers to a cancellation point */
+	wq_wake_all(wq);
+
+	for (i = 0; i < wq->nr_threads; i++)
+		if (wq_joinable(wq, i))
+			pthread_join(wq->threads[i], NULL);
+
+	wq->nr_threads = 0;
+
+	return ret;
 }
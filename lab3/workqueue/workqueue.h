@@ -1,24 +1,258 @@
 #ifndef _WORKQUEUE_H_
 #define _WORKQUEUE_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <pthread.h>
-#include <semaphore.h>
 
+#ifndef container_of
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
+/*
+ * Priority lanes, workers always take from the highest non-empty one. A
+ * lower lane which has been passed over WQ_STARVE_LIMIT times in a row
+ * gets the next turn, so it keeps moving under a flood of higher work.
+ */
+#define WQ_PRIO_HIGH 0
+#define WQ_PRIO_NORMAL 1
+#define WQ_PRIO_LOW 2
+#define WQ_NR_PRIO 3
+#define WQ_STARVE_LIMIT 8
+
+/*
+ * Work item to embed into caller's own structure, like in the kernel.
+ * It must not be queued again before its func has been called, but func
+ * itself may queue it again.
+ */
+struct work {
+	void (*func)(struct work *work);
+	_Atomic(struct work *) next;
+	unsigned int color;
+	unsigned int prio;
+};
+
+static inline void wq_init_work(struct work *work,
+	void (*func)(struct work *work))
+{
+	work->func = func;
+	atomic_init(&work->next, NULL);
+	work->prio = WQ_PRIO_NORMAL;
+}
+
+/* Must not be called while the work is queued */
+static inline void wq_set_prio(struct work *work, unsigned int prio)
+{
+	work->prio = prio < WQ_NR_PRIO ? prio : WQ_NR_PRIO - 1;
+}
+
+/* Work item of wq_add(), recycled through per-queue free list */
 struct task {
+	struct work work;
 	void (*handler)(void *cookie);
 	void *cookie;
-	struct task *next;
+	struct workqueue *wq;
+	struct task *free_next;
+};
+
+/*
+ * Work item run after a delay in ms, or every period ms if it is periodic. It
+ * may be queued again once it is idle: one-shot work becomes idle right
+ * before its handler is called, periodic work only when cancelled, which
+ * wq_cancel_delayed_sync() waits for. The rest is private to the timer
+ * wheel and protected by timer_lock.
+ */
+struct delayed_work {
+	struct work work;
+	void (*handler)(void *cookie);
+	void *cookie;
+
+	struct workqueue *wq;
+	uint64_t expires;
+	unsigned long period;
+	struct delayed_work *next;
+	struct delayed_work **pprev;
+	unsigned int level;
+	unsigned int slot;
+	int state;
+	bool cancelled;
+	bool autofree;
+};
+
+static inline void wq_init_delayed(struct delayed_work *dw,
+	void (*handler)(void *cookie), void *cookie)
+{
+	wq_init_work(&dw->work, NULL);
+	dw->handler = handler;
+	dw->cookie = cookie;
+	dw->state = 0;
+	dw->autofree = false;
+}
+
+/*
+ * Hierarchical timer wheel with 1 ms ticks. Level n slot covers 64^n
+ * ticks, its timers are cascaded to lower levels when clk gets there.
+ * pending has a bit set for every non-empty slot, so the next event is
+ * found without walking slots.
+ */
+#define WQ_WHEEL_BITS 6
+#define WQ_WHEEL_SIZE (1 << WQ_WHEEL_BITS)
+#define WQ_WHEEL_LEVELS 4
+
+/*
+ * Work items of every priority are kept in an intrusive MPSC queue:
+ * producers only swap tail and link the old one to the new item, never
+ * taking a lock. Head is owned by consumer, the stub is put back into the
+ * queue whenever the last item is taken, so a taken item is never
+ * referenced by the queue. starved counts items taken from higher lanes
+ * while this one was waiting.
+ */
+struct wq_lane {
+	_Atomic(struct work *) tail;
+	struct work *head;
+	struct work stub;
+	unsigned int starved;
+};
+
+/*
+ * Chase-Lev deque of a per-CPU worker: only the owner pushes and pops at
+ * bottom, workers of other CPUs steal from top.
+ */
+#define WQ_DEQUE_SIZE 256
+
+struct wq_deque {
+	atomic_long top;
+	atomic_long bottom;
+	_Atomic(struct work *) buf[WQ_DEQUE_SIZE];
 };
 
+/*
+ * Per-CPU part of the queue. Submitters running on the CPU push to its
+ * lanes, items queued by its own worker go to the deque. The worker parks
+ * on its own wake_seq, so that it can be woken up alone.
+ */
+struct wq_cpu {
+	struct wq_lane lanes[WQ_NR_PRIO];
+	atomic_flag pop_lock;
+	struct wq_deque deque;
+	unsigned int skipped;
+	atomic_uint wake_seq;
+	atomic_bool parked;
+	int cpu;
+	struct workqueue *wq;
+};
+
+/*
+ * Pool workers take turns on lane heads under pop_lock. Per-CPU queue
+ * doesn't use them, it has lanes of its own on every CPU.
+ */
 struct workqueue {
-	struct task *task;
-	struct task **new;
-	pthread_t thread;
-	sem_t sem;
+	struct wq_lane lanes[WQ_NR_PRIO];
+	atomic_flag pop_lock;
+	bool shared;
+
+	/*
+	 * Workers push freed tasks lock-free, wq_add() takes all of them at
+	 * once into a cache of its thread. Id tells which queue the cache
+	 * belongs to, it is never reused.
+	 */
+	_Atomic(struct task *) free;
+	unsigned long id;
+
+	/*
+	 * Flush colors, like in the kernel: every item is counted in
+	 * in_flight of the color current at submission. wq_flush() flips
+	 * the color and waits for the old one to drain.
+	 */
+	atomic_uint color;
+	atomic_long in_flight[2];
+	atomic_int flushers;
+	pthread_mutex_t flush_lock;
+	pthread_mutex_t done_lock;
+	pthread_cond_t done;
+
+	/*
+	 * Idle worker polls the queue spin times before parking on wake_seq
+	 * futex. Producers bump wake_seq and wake only if someone is parked.
+	 * A woken worker runs everything it finds, so a batch needs no more
+	 * wakeups than there are workers.
+	 */
+	atomic_uint spin;
+	atomic_uint nr_parked;
+	atomic_uint wake_seq;
+
+	/*
+	 * Workers service the wheel between tasks. next_timer is the time
+	 * of the earliest event, UINT64_MAX if there are none, so workers
+	 * only look at the clock while something is armed.
+	 */
+	struct delayed_work *wheel[WQ_WHEEL_LEVELS][WQ_WHEEL_SIZE];
+	uint64_t pending[WQ_WHEEL_LEVELS];
+	uint64_t clk;
+	_Atomic uint64_t next_timer;
+	pthread_mutex_t timer_lock;
+	pthread_cond_t timer_idle;
+
+	atomic_bool stopping;
+	pthread_t *threads;
+	unsigned int nr_threads;
+	unsigned int max_threads;
+
+	/*
+	 * Managed pool only. nr_running counts workers which are neither
+	 * parked nor blocked, more are started while it is below concurrency
+	 * and work is waiting. slots tell which threads are alive and which
+	 * have exited, but are yet to be joined.
+	 */
+	bool managed;
+	unsigned int concurrency;
+	unsigned int min_threads;
+	atomic_uint nr_running;
+	atomic_uint nr_workers;
+	unsigned char *slots;
+	pthread_mutex_t manage_lock;
+
+	/* Per-CPU queue only, cpu_map turns CPU number into index in cpus */
+	struct wq_cpu *cpus;
+	unsigned int nr_cpus;
+	int *cpu_map;
 };
 
+#define WQ_DEFAULT_SPIN 200
+
+/* Managed pool worker idle for that many ms exits */
+#define WQ_IDLE_TIMEOUT 5000
+
 int wq_init(struct workqueue *wq);
+int wq_init_pool(struct workqueue *wq, unsigned int nthreads, bool ordered);
+int wq_init_percpu(struct workqueue *wq);
+int wq_init_managed(struct workqueue *wq, unsigned int min, unsigned int max);
+int wq_queue_work(struct workqueue *wq, struct work *work);
+int wq_queue_work_on(struct workqueue *wq, int cpu, struct work *work);
+int wq_queue_batch(struct workqueue *wq, struct work **works, unsigned int nr);
 int wq_add(struct workqueue *wq, void (*handler)(void *), void *cookie);
+int wq_add_on(struct workqueue *wq, int cpu, void (*handler)(void *),
+	void *cookie);
+int wq_add_prio(struct workqueue *wq, unsigned int prio,
+	void (*handler)(void *), void *cookie);
+int wq_add_batch(struct workqueue *wq, void (*handler)(void *),
+	void **cookies, unsigned int nr);
+void wq_flush(struct workqueue *wq);
+void wq_destroy(struct workqueue *wq);
+void wq_set_spin(struct workqueue *wq, unsigned int spin);
+int wq_queue_delayed(struct workqueue *wq, struct delayed_work *dw,
+	unsigned long delay);
+int wq_queue_periodic(struct workqueue *wq, struct delayed_work *dw,
+	unsigned long period);
+bool wq_cancel_delayed(struct workqueue *wq, struct delayed_work *dw);
+bool wq_cancel_delayed_sync(struct workqueue *wq, struct delayed_work *dw);
+int wq_add_delayed(struct workqueue *wq, void (*handler)(void *),
+	void *cookie, unsigned long delay);
+void wq_block_begin(struct workqueue *wq);
+void wq_block_end(struct workqueue *wq);
 int wq_cancel(struct workqueue *wq);
 
 #endif